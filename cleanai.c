@@ -6,6 +6,10 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "libs/cJSON.h"
 #include "libs/cJSON.c"
@@ -13,10 +17,16 @@
 #include "libs/miniz.h"
 #include "libs/miniz.c"
 
+//Shared memory options, set from the config before the model gets allocated.
+bool shm_hugepages = false; //back shared memory with 2MiB pages (hugetlbfs if mounted, transparent hugepages otherwise)
+bool shm_prefault = false; //fault every page in when mapping instead of on first touch
+bool shm_keep = false; //leave the segments we created behind on exit (--keep-shm)
+
 #ifdef _WIN32 //windows compability is pain ;(
 #include <windows.h>
 #include <conio.h>
 #include <tlhelp32.h>
+#include <io.h>
 
 unsigned long getPid(){
     return (unsigned long)GetCurrentProcessId();
@@ -93,7 +103,8 @@ char* input_with_timeout(char* qry, int timeout_ms){
     return buff;
 }
 
-void* smalloc(size_t size, const char* sharename){
+//Large pages need SeLockMemoryPrivilege on windows so hugepages and shm_prefault are ignored here.
+void* smalloc(size_t size, const char* sharename, bool hugepages){
     HANDLE hMap = CreateFileMappingA(
         INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
         (DWORD)((unsigned long long)size >> 32),
@@ -107,16 +118,77 @@ void* smalloc(size_t size, const char* sharename){
     return p;
 }
 
-void* rmalloc(const char* sharename){
-    HANDLE hMap = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, sharename);
+//Maps an existing segment, read only unless writable.
+void* rmalloc(const char* sharename, bool writable, bool on_hugetlbfs){
+    DWORD access = writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ;
+    HANDLE hMap = OpenFileMappingA(access, FALSE, sharename);
     if (!hMap) return NULL;
 
     /* 0 size maps the entire section on Windows */
-    void* p = MapViewOfFile(hMap, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    void* p = MapViewOfFile(hMap, access, 0, 0, 0);
+    CloseHandle(hMap);
+    return p;
+}
+
+int cpu_count(){
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+//Maps a whole file, a private copy on write view if writable (the file itself never changes) or a shared read only one otherwise.
+void* map_file(const char* path, bool writable, size_t* size){
+    HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(hFile, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(hFile);
+        return NULL;
+    }
+    *size = (size_t)file_size.QuadPart;
+
+    HANDLE hMap = CreateFileMappingA(hFile, NULL, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile); // mapping keeps the file open
+    if (!hMap) return NULL;
+
+    void* p = MapViewOfFile(hMap, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
     CloseHandle(hMap);
     return p;
 }
 
+//Undoes map_file, the file's handle went with the view.
+void unmap_file(void* p, size_t size){
+    UnmapViewOfFile(p);
+}
+
+//Flushes file all the way to the disk, so a rename over the old copy can't leave an empty file behind after a crash.
+bool sync_file(FILE* file){
+    if (fflush(file) != 0){
+        return false;
+    }
+    return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(file))) != 0;
+}
+
+//Atomically puts from in place of to. Fails while to is mapped, which leaves it untouched.
+bool replace_file(const char* from, const char* to){
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+//Named mappings die with their last handle on windows, there is nothing to unlink.
+void shm_cleanup(){
+    return;
+}
+
+//Nothing outlives a crash here either, so there is nothing stale to look for.
+bool shm_claim(const char* model_id){
+    return true;
+}
+
+bool shm_on_hugetlbfs(const char* sharename){
+    return false;
+}
+
 #else
 #include <sys/time.h>
 #include <sys/select.h>
@@ -124,6 +196,8 @@ void* rmalloc(const char* sharename){
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
 
 unsigned long getPid(){
     return (unsigned long)getpid();
@@ -186,27 +260,202 @@ char* input_with_timeout(char* qry, int timeout_ms){
     return NULL;
 }
 
-void* smalloc(size_t size, const char* sharename){
-    int fd = shm_open(sharename, O_CREAT | O_RDWR, 0666);
-    if (fd == -1) return NULL;
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGETLBFS_DIR "/dev/hugepages"
+
+//Opens sharename on hugetlbfs if asked to and it is mounted, in /dev/shm otherwise.
+int shm_fd(const char* sharename, int oflag, bool try_hugetlbfs, bool* on_hugetlbfs){
+    *on_hugetlbfs = false;
+    if (try_hugetlbfs){
+        char path[4096];
+        snprintf(path, sizeof path, "%s%s", HUGETLBFS_DIR, sharename);
+        int fd = open(path, oflag, 0666);
+        if (fd != -1){
+            *on_hugetlbfs = true;
+            return fd;
+        }
+        if (errno == EEXIST){
+            return -1; //already there, a second copy in /dev/shm would just hide it
+        }
+    }
+    return shm_open(sharename, oflag, 0666);
+}
+
+void shm_remove(const char* sharename, bool on_hugetlbfs){
+    if (on_hugetlbfs){
+        char path[4096];
+        snprintf(path, sizeof path, "%s%s", HUGETLBFS_DIR, sharename);
+        unlink(path);
+        return;
+    }
+    shm_unlink(sharename);
+}
+
+//Every segment this process created, shm_cleanup() unlinks them on exit or on a fatal signal unless shm_keep is set.
+typedef struct {
+    char* name;
+    bool on_hugetlbfs;
+} shm_segment;
+
+shm_segment* shm_registry = NULL;
+int shm_registry_len = 0;
+char* shm_lock_name = NULL; //see shm_claim(), unlinked on exit even with shm_keep
+
+void shm_register(const char* sharename, bool on_hugetlbfs){
+    shm_segment* tmp = realloc(shm_registry, (shm_registry_len + 1) * sizeof(shm_segment));
+    if (!tmp){
+        printf("Failed to allocate memory to track shared memory segment \"%s\", it will leak.\n", sharename);
+        return;
+    }
+    shm_registry = tmp;
+    shm_registry[shm_registry_len].name = malloc(strlen(sharename) + 1);
+    if (!shm_registry[shm_registry_len].name){
+        printf("Failed to allocate memory to track shared memory segment \"%s\", it will leak.\n", sharename);
+        return;
+    }
+    strcpy(shm_registry[shm_registry_len].name, sharename);
+    shm_registry[shm_registry_len].on_hugetlbfs = on_hugetlbfs;
+    shm_registry_len++;
+}
+
+void shm_cleanup(){
+    if (shm_lock_name){
+        shm_unlink(shm_lock_name);
+        shm_lock_name = NULL;
+    }
+    if (shm_keep){
+        return;
+    }
+    for (int index = 0; index < shm_registry_len; index++){
+        shm_remove(shm_registry[index].name, shm_registry[index].on_hugetlbfs);
+    }
+    shm_registry_len = 0;
+}
+
+//For forked children, the segments belong to the parent and must outlive the child.
+void shm_forget(){
+    shm_registry_len = 0;
+    shm_lock_name = NULL;
+}
 
-    if (ftruncate(fd, (off_t)size) == -1) {
+//Takes "/<model id>_lock" and holds an flock on it for as long as this process or any child of it runs. If the lock
+//is there but nobody holds it, the run that made it was killed before it could clean up (SIGKILL, the OOM killer...)
+//so its model and manifest segments are removed instead of making every later start with this id fail.
+//Segments kept with --keep-shm have no lock once their run exits, they are left alone.
+bool shm_claim(const char* model_id){
+    char name[128];
+    snprintf(name, sizeof name, "/%s_lock", model_id);
+    bool leftover = false;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if ((fd == -1) && (errno == EEXIST)){
+        leftover = true;
+        fd = shm_open(name, O_RDWR, 0666);
+    }
+    if (fd == -1){
+        printf("Failed to create shared memory lock \"%s\".\n", name);
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1){
         close(fd);
-        shm_unlink(sharename);
-        return NULL;
+        printf("Model \"%s\" is in use by another process, --attach to it or pick another --model-id.\n", model_id);
+        return false;
+    }
+    shm_lock_name = malloc(strlen(name) + 1);
+    if (!shm_lock_name){
+        printf("Failed to allocate memory to track shared memory segment \"%s\", it will leak.\n", name);
+    }
+    else{
+        strcpy(shm_lock_name, name);
+    }
+    if (leftover){
+        const char* segments[] = {"model", "manifest"};
+        for (int index = 0; index < 2; index++){
+            char segment[128];
+            snprintf(segment, sizeof segment, "/%s_%s", model_id, segments[index]);
+            shm_remove(segment, true);
+            shm_remove(segment, false);
+        }
+        printf("Removed shared memory left behind by a run of model \"%s\" that didn't exit cleanly.\n", model_id);
+    }
+    return true; //fd stays open, the lock goes with it
+}
+
+//Whether smalloc ended up putting sharename on hugetlbfs, whoever maps it later has to look there.
+bool shm_on_hugetlbfs(const char* sharename){
+    for (int index = 0; index < shm_registry_len; index++){
+        if (strcmp(shm_registry[index].name, sharename) == 0){
+            return shm_registry[index].on_hugetlbfs;
+        }
+    }
+    return false;
+}
+
+//What smalloc actually maps for size bytes with shm_hugepages, needed to munmap it.
+size_t shm_mapped_size(size_t size){
+    if (shm_hugepages){
+        return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+    return size;
+}
+
+//Mappings are page aligned, which covers the 64 byte alignment the kernels want. hugepages is meant to be shm_hugepages,
+//false for small segments that would waste most of a huge page.
+//Fails if sharename already exists so two models can't end up in the same segment.
+void* smalloc(size_t size, const char* sharename, bool hugepages){
+    bool on_hugetlbfs;
+    int fd = shm_fd(sharename, O_CREAT | O_EXCL | O_RDWR, hugepages, &on_hugetlbfs);
+    if (fd == -1) return NULL;
+
+    if (hugepages){
+        size = shm_mapped_size(size); //hugetlbfs only deals in whole pages
     }
 
-    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    //Transparent hugepages have to be asked for before the first fault, so populate after madvise in that case.
+    bool populate_now = shm_prefault && (on_hugetlbfs || !hugepages);
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | (populate_now ? MAP_POPULATE : 0), fd, 0);
+    }
     close(fd);
+    if ((p == MAP_FAILED) && on_hugetlbfs) {
+        //hugetlbfs is mounted but its pool is empty or too small (nothing is reserved by default), /dev/shm with transparent hugepages then.
+        shm_remove(sharename, true);
+        on_hugetlbfs = false;
+        populate_now = false;
+        fd = shm_open(sharename, O_CREAT | O_EXCL | O_RDWR, 0666);
+        if (fd == -1) return NULL;
+        if (ftruncate(fd, (off_t)size) == 0) {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
     if (p == MAP_FAILED) {
-        shm_unlink(sharename);
+        shm_remove(sharename, on_hugetlbfs);
         return NULL;
     }
+    shm_register(sharename, on_hugetlbfs);
+
+    if (hugepages && !on_hugetlbfs){
+        madvise(p, size, MADV_HUGEPAGE); //only a hint, /sys/kernel/mm/transparent_hugepage/shmem_enabled decides
+        if (shm_prefault){
+#ifdef MADV_POPULATE_WRITE
+            if (madvise(p, size, MADV_POPULATE_WRITE) == -1)
+#endif
+            {
+                long page = sysconf(_SC_PAGESIZE);
+                for (size_t offset = 0; offset < size; offset += page){
+                    ((volatile char*)p)[offset] = 0;
+                }
+            }
+        }
+    }
     return p;
 }
 
-void* rmalloc(const char* sharename){
-    int fd = shm_open(sharename, O_RDWR, 0666);
+//Maps an existing segment, read only unless writable. Read only mappings of the model are how several processes share one copy of the weights.
+//on_hugetlbfs says where the creator put it, see shm_on_hugetlbfs().
+void* rmalloc(const char* sharename, bool writable, bool on_hugetlbfs){
+    int fd = on_hugetlbfs ? shm_fd(sharename, writable ? O_RDWR : O_RDONLY, true, &on_hugetlbfs) : shm_open(sharename, writable ? O_RDWR : O_RDONLY, 0666);
     if (fd == -1) return NULL;
 
     struct stat st;
@@ -216,13 +465,81 @@ void* rmalloc(const char* sharename){
     }
     size_t size = (size_t)st.st_size;
 
-    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* p = mmap(NULL, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    return p;
+}
+
+int cpu_count(){
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+//Maps a whole file, a private copy on write view if writable (the file itself never changes) or a shared read only one otherwise.
+void* map_file(const char* path, bool writable, size_t* size){
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+
+    void* p = mmap(NULL, *size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
     close(fd);
     if (p == MAP_FAILED) return NULL;
     return p;
 }
+
+//Undoes map_file, the fd is already closed.
+void unmap_file(void* p, size_t size){
+    munmap(p, size);
+}
+
+//Flushes file all the way to the disk, so a rename over the old copy can't leave an empty file behind after a crash.
+bool sync_file(FILE* file){
+    if (fflush(file) != 0){
+        return false;
+    }
+    return fsync(fileno(file)) == 0;
+}
+
+//Atomically puts from in place of to. Whoever still maps the old to keeps its pages, the inode lives on until they unmap.
+bool replace_file(const char* from, const char* to){
+    return rename(from, to) == 0;
+}
+
+//printf straight to fd in a single write, for processes sharing a stdout where buffered output would interleave or get lost.
+bool write_line(int fd, const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0){
+        return false;
+    }
+    char* text = malloc((size_t)(len) + 1);
+    if (!text){
+        return false;
+    }
+    va_start(args, format);
+    vsnprintf(text, (size_t)(len) + 1, format, args);
+    va_end(args);
+    bool ok = write(fd, text, len) == len;
+    free(text);
+    return ok;
+}
 #endif
 
+void shm_cleanup_on_signal(int sig){
+    shm_cleanup();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
 int itoa(int value, char* buff, int base){
     //fuck base
     return sprintf(buff, "%d", value);
@@ -286,6 +603,17 @@ void help(char* issue){
     printf("                                                                          [--pretrain]\n");
     printf("                                                              [--pretrain]\n");
     printf("                                                                          [--train]\n");
+    printf("        --attach model-id\n");
+    printf("                         [--config path/to/config.json]\n");
+    printf("\n");
+    printf("--new and --load also take:\n");
+    printf("        [--model-id id] names the model in shared memory so other processes can --attach to it (default: the pid)\n");
+    printf("        [--keep-shm] leaves the model in shared memory after exiting\n");
+    printf("        [--workers count] serves requests from stdin with count processes sharing the model read only\n");
+    printf("\n");
+    printf("Any mode also takes:\n");
+    printf("        [--checkpoint-compression store|fast|default|best] overrides checkpoint-compression from the config\n");
+    printf("        [--export-inference path/to/model.zip] also saves the model without its adam moments, a third of the size\n");
     printf("\n");
     printf("Note: Arguments between square brackets ([...]) are optional.\n");
 }
@@ -330,115 +658,1743 @@ char* read_file(const char* path) {
     return buffer;
 }
 
-int main(int argc, char** argv){
-    int* ids = malloc(1); //1 byte init alloc
-
-    if (!ids){
-        printf("Failed memory allocation for ids, ids will not be tracked therefore ids may not be strictly unique.\n");
+//Per thread scratch memory for activations. Bump allocated and reset once per step so the hot loop never touches the heap.
+//When a block runs out a bigger one is chained in front, the next reset folds everything back into one block.
+typedef struct workspace_block {
+    char* raw; //what malloc gave us
+    char* base; //raw rounded up to 64 bytes
+    size_t size;
+    size_t used;
+    struct workspace_block* prev;
+} workspace_block;
+
+__thread workspace_block* workspace = NULL;
+
+workspace_block* ws_new_block(size_t size, workspace_block* prev){
+    workspace_block* block = malloc(sizeof(workspace_block));
+    if (!block){
+        printf("Failed to allocate memory for the workspace.\n");
+        exit(1);
     }
+    block->raw = malloc(size + 63);
+    if (!block->raw){
+        printf("Failed to allocate memory for the workspace.\n");
+        exit(1);
+    }
+    block->base = (char*)(((uintptr_t)(block->raw) + 63) & ~(uintptr_t)(63));
+    block->size = size;
+    block->used = 0;
+    block->prev = prev;
+    return block;
+}
 
-    int ids_len = 0;
-
-    srand(time(NULL));
+//Makes sure the calling thread's workspace can hold size bytes without growing.
+void ws_reserve(size_t size){
+    if (workspace && workspace->size - workspace->used >= size){
+        return;
+    }
+    workspace = ws_new_block(size, workspace);
+}
 
-    int genid(){
-        int id;
-        while (true){
-            id = rand() % 100000;
+//64 byte aligned, valid until the next ws_reset() of this thread.
+void* ws_alloc(size_t size){
+    size = (size + 63) & ~(size_t)(63);
+    if (!workspace || workspace->size - workspace->used < size){
+        size_t grow = workspace ? workspace->size * 2 : 1024 * 1024;
+        if (grow < size){
+            grow = size;
+        }
+        workspace = ws_new_block(grow, workspace);
+    }
+    void* p = workspace->base + workspace->used;
+    workspace->used += size;
+    return p;
+}
 
-            if (!ids){
-                return id;
-            }
+void ws_reset(){
+    if (!workspace){
+        return;
+    }
+    if (workspace->prev){
+        //Ran out last step, replace the chain with one block big enough for all of it.
+        size_t total = 0;
+        while (workspace){
+            workspace_block* prev = workspace->prev;
+            total += workspace->size;
+            free(workspace->raw);
+            free(workspace);
+            workspace = prev;
+        }
+        workspace = ws_new_block(total, NULL);
+        return;
+    }
+    workspace->used = 0;
+}
 
-            if (ids_len == 100000){
-                printf("All possible ids combinations exhaused, this id will be a duplicate of another id.\n");
-                return id;
-            }
+//Vector kernels (unit stride). The build doesn't assume any instruction set, select_kernels() picks the widest
+//one the cpu has at startup. Several accumulators keep that many FMAs in flight instead of waiting on one.
+float dot_f32_scalar(const float* a, const float* b, size_t n){
+    float sum0 = 0;
+    float sum1 = 0;
+    float sum2 = 0;
+    float sum3 = 0;
+    size_t index = 0;
+    for (; index + 4 <= n; index += 4){
+        sum0 += a[index] * b[index];
+        sum1 += a[index + 1] * b[index + 1];
+        sum2 += a[index + 2] * b[index + 2];
+        sum3 += a[index + 3] * b[index + 3];
+    }
+    for (; index < n; index++){
+        sum0 += a[index] * b[index];
+    }
+    return (sum0 + sum1) + (sum2 + sum3);
+}
 
-            bool found = false;
-            for (int index = 0; index < ids_len; index++){
-                if (ids[index] == id){
-                    found = true;
-                    break;
-                }
-            }
+void add_f32_scalar(float* dst, const float* a, const float* b, size_t n){
+    for (size_t index = 0; index < n; index++){
+        dst[index] = a[index] + b[index];
+    }
+}
 
-            if (!found){
-                break;
-            }
-        }
-        //grw
-        int* tmp_ids = realloc(ids, (ids_len + 1) * sizeof(int));
-        if (!tmp_ids){
-            printf("Failed memory allocation to grow ids list.\n");
-            return id; //better to return something than nothing
-        }
-        ids = tmp_ids;
+//LayerNorm in two passes: sum and sum of squares together, then normalize and apply g and b.
+//The sums are taken relative to the first element so large offsets don't cancel out the variance.
+void layernorm_stats(float sum, float sumsq, float shift, size_t n, float* mean, float* rstd){
+    float shifted_mean = sum / n;
+    float varience = sumsq / n - shifted_mean * shifted_mean;
+    if (varience < 0){
+        varience = 0;
+    }
+    *mean = shift + shifted_mean;
+    *rstd = 1.0f / sqrtf(varience + 1e-8f);
+}
 
-        ids[ids_len] = id;
-        ids_len++;
-        return id;
+void layernorm_f32_scalar(float* dst, const float* in, const float* g, const float* b, size_t n){
+    float shift = in[0];
+    float sum0 = 0;
+    float sum1 = 0;
+    float sumsq0 = 0;
+    float sumsq1 = 0;
+    size_t index = 0;
+    for (; index + 2 <= n; index += 2){
+        float d0 = in[index] - shift;
+        float d1 = in[index + 1] - shift;
+        sum0 += d0;
+        sum1 += d1;
+        sumsq0 += d0 * d0;
+        sumsq1 += d1 * d1;
+    }
+    for (; index < n; index++){
+        float d = in[index] - shift;
+        sum0 += d;
+        sumsq0 += d * d;
     }
+    float mean;
+    float rstd;
+    layernorm_stats(sum0 + sum1, sumsq0 + sumsq1, shift, n, &mean, &rstd);
+    for (index = 0; index < n; index++){
+        dst[index] = (in[index] - mean) * rstd * g[index] + b[index];
+    }
+}
 
-    int freeId(int id){
-        int indexOfId = -1;
-        for (int index = 0; index < ids_len; index++){
-            if (id == ids[index]){
-                indexOfId = index;
-                break;
-            }
-        }
-        if (indexOfId == -1){
-            return -1; //id not found
-        }
+//exp(x) as 2^k * p(r) with r = x - k * ln2 in [-ln2/2, ln2/2]. fast uses a cubic for p (about 1e-4 relative error),
+//otherwise it's the Cephes polynomial (about 1e-7). Below -87 it underflows to 0, above 88 it saturates.
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_LN2_HI 0.693359375f
+#define EXP_LN2_LO -2.12194440e-4f
+float exp_f32(float x, bool fast){
+    if (x < -87.0f){
+        return 0;
+    }
+    if (x > 88.0f){
+        x = 88.0f;
+    }
+    float k = rintf(x * EXP_LOG2E);
+    float r = x - k * EXP_LN2_HI - k * EXP_LN2_LO;
+    float p;
+    if (fast){
+        p = 0.9999289226f + r * (1.000186226f + r * (0.504949177f + r * 0.1654193617f));
+    }
+    else{
+        p = 1.9875691500e-4f;
+        p = p * r + 1.3981999507e-3f;
+        p = p * r + 8.3334519073e-3f;
+        p = p * r + 4.1665795894e-2f;
+        p = p * r + 1.6666665459e-1f;
+        p = p * r + 5.0000001201e-1f;
+        p = p * r * r + r + 1.0f;
+    }
+    int32_t bits = ((int32_t)(k) + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof scale);
+    return p * scale;
+}
 
-        //shrnk
-        int* n_ids = malloc((ids_len - 1) * sizeof(int));
-        if (!n_ids){
-            printf("Failed to allocate memory to shrink ids list.\n");
-            return -1;
+//dst = softmax(in), dst may be in. Sums stay in float, spread over several accumulators.
+void softmax_f32_scalar(float* dst, const float* in, size_t n, bool fast){
+    float max = -__FLT_MAX__;
+    for (size_t index = 0; index < n; index++){
+        if (in[index] > max){
+            max = in[index];
         }
+    }
+    float sum0 = 0;
+    float sum1 = 0;
+    size_t index = 0;
+    for (; index + 2 <= n; index += 2){
+        dst[index] = exp_f32(in[index] - max, fast);
+        dst[index + 1] = exp_f32(in[index + 1] - max, fast);
+        sum0 += dst[index];
+        sum1 += dst[index + 1];
+    }
+    for (; index < n; index++){
+        dst[index] = exp_f32(in[index] - max, fast);
+        sum0 += dst[index];
+    }
+    float sum = sum0 + sum1;
+    //Only when every input is -inf, there's no telling them apart then.
+    float scale = (sum == 0) ? 0 : 1.0f / sum;
+    for (index = 0; index < n; index++){
+        dst[index] = (sum == 0) ? 1.0f / (float)(n) : dst[index] * scale;
+    }
+}
 
-        int offset = 0;
-        for (int index = 0; index < ids_len; index++){
-            if (index == indexOfId){
-                offset += 1;
-                continue;
+//GEMM micro-kernels, see sgemm(). They compute one full MR x NR tile of C from kc steps of packed A (MR floats per step)
+//and packed B (NR floats per step), the whole tile staying in registers. The tile is then added to C when accumulate is
+//set, otherwise it overwrites C, with bias[0..NR) added to every row if there is one. The tile loops are unrolled up front,
+//GCC only keeps an array of accumulators in registers when nothing indexes it at runtime.
+#define GEMM_SCALAR_MR 4
+#define GEMM_SCALAR_NR 8
+#define GEMM_AVX2_MR 6 //12 accumulators, 2 B vectors and the broadcast A value out of 16 registers
+#define GEMM_AVX2_NR 16
+#define GEMM_AVX512_MR 12 //24 accumulators out of 32
+#define GEMM_AVX512_NR 32
+void gemm_micro_scalar(int kc, const float* a, const float* b, float* c, size_t ldc, const float* bias, bool accumulate){
+    float acc[GEMM_SCALAR_MR][GEMM_SCALAR_NR] = {{0}};
+    for (int step = 0; step < kc; step++){
+        #pragma GCC unroll 32
+        for (int row = 0; row < GEMM_SCALAR_MR; row++){
+            #pragma GCC unroll 32
+            for (int col = 0; col < GEMM_SCALAR_NR; col++){
+                acc[row][col] += a[row] * b[col];
+            }
+        }
+        a += GEMM_SCALAR_MR;
+        b += GEMM_SCALAR_NR;
+    }
+    #pragma GCC unroll 32
+    for (int row = 0; row < GEMM_SCALAR_MR; row++){
+        #pragma GCC unroll 32
+        for (int col = 0; col < GEMM_SCALAR_NR; col++){
+            if (accumulate){
+                acc[row][col] += c[row * ldc + col];
             }
-            n_ids[index - offset] = ids[index];
+            else{
+                if (bias){
+                    acc[row][col] += bias[col];
+                }
+            }
+            c[row * ldc + col] = acc[row][col];
         }
+    }
+}
 
-        free(ids);
-        ids = n_ids;
-        ids_len--;
-        return 0;
+//GEMV kernels, see sgemv(). y[rows] = w[rows x cols] * x + bias, rows ldw floats apart, bias can be NULL. One token at a
+//time every weight is read once and used once, so this runs at memory speed: GEMV_ROWS rows go through together to
+//share each load of x, and every row is prefetched GEMV_PREFETCH floats ahead of where it's being read.
+#define GEMV_ROWS 4
+#define GEMV_PREFETCH 256
+void gemv_f32_scalar(float* y, const float* w, size_t ldw, const float* x, const float* bias, int rows, int cols){
+    int row = 0;
+    for (; row + GEMV_ROWS <= rows; row += GEMV_ROWS){
+        const float* w0 = w + (size_t)(row) * ldw;
+        const float* w1 = w0 + ldw;
+        const float* w2 = w1 + ldw;
+        const float* w3 = w2 + ldw;
+        float sum0 = 0;
+        float sum1 = 0;
+        float sum2 = 0;
+        float sum3 = 0;
+        for (int col = 0; col < cols; col++){
+            if ((col & 15) == 0){
+                __builtin_prefetch(w0 + col + GEMV_PREFETCH);
+                __builtin_prefetch(w1 + col + GEMV_PREFETCH);
+                __builtin_prefetch(w2 + col + GEMV_PREFETCH);
+                __builtin_prefetch(w3 + col + GEMV_PREFETCH);
+            }
+            sum0 += w0[col] * x[col];
+            sum1 += w1[col] * x[col];
+            sum2 += w2[col] * x[col];
+            sum3 += w3[col] * x[col];
+        }
+        y[row] = sum0 + (bias ? bias[row] : 0);
+        y[row + 1] = sum1 + (bias ? bias[row + 1] : 0);
+        y[row + 2] = sum2 + (bias ? bias[row + 2] : 0);
+        y[row + 3] = sum3 + (bias ? bias[row + 3] : 0);
     }
+    for (; row < rows; row++){
+        y[row] = dot_f32_scalar(w + (size_t)(row) * ldw, x, cols) + (bias ? bias[row] : 0);
+    }
+}
 
-    long long** timers = malloc(1); //1 byte init alloc
-    
-    if (!timers){
-        printf("Failed memory allocation for timers, timers will not be available.\n");
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+float dot_f32_sse2(const float* a, const float* b, size_t n){
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    __m128 sum2 = _mm_setzero_ps();
+    __m128 sum3 = _mm_setzero_ps();
+    size_t index = 0;
+    for (; index + 16 <= n; index += 16){
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + index), _mm_loadu_ps(b + index)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + index + 4), _mm_loadu_ps(b + index + 4)));
+        sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(a + index + 8), _mm_loadu_ps(b + index + 8)));
+        sum3 = _mm_add_ps(sum3, _mm_mul_ps(_mm_loadu_ps(a + index + 12), _mm_loadu_ps(b + index + 12)));
+    }
+    for (; index + 4 <= n; index += 4){
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + index), _mm_loadu_ps(b + index)));
+    }
+    __m128 sum = _mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float total = _mm_cvtss_f32(sum);
+    for (; index < n; index++){
+        total += a[index] * b[index];
     }
+    return total;
+}
 
-    int timers_len = 0; //0 elements
+__attribute__((target("sse2")))
+void add_f32_sse2(float* dst, const float* a, const float* b, size_t n){
+    size_t index = 0;
+    for (; index + 4 <= n; index += 4){
+        _mm_storeu_ps(dst + index, _mm_add_ps(_mm_loadu_ps(a + index), _mm_loadu_ps(b + index)));
+    }
+    for (; index < n; index++){
+        dst[index] = a[index] + b[index];
+    }
+}
 
-    long long timer(){
-        if (!timers){
-            return -1;
-        }
+__attribute__((target("avx2,fma")))
+float dot_f32_avx2(const float* a, const float* b, size_t n){
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps();
+    __m256 sum3 = _mm256_setzero_ps();
+    size_t index = 0;
+    for (; index + 32 <= n; index += 32){
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + index), _mm256_loadu_ps(b + index), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + index + 8), _mm256_loadu_ps(b + index + 8), sum1);
+        sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + index + 16), _mm256_loadu_ps(b + index + 16), sum2);
+        sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + index + 24), _mm256_loadu_ps(b + index + 24), sum3);
+    }
+    for (; index + 8 <= n; index += 8){
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + index), _mm256_loadu_ps(b + index), sum0);
+    }
+    __m256 sum8 = _mm256_add_ps(_mm256_add_ps(sum0, sum1), _mm256_add_ps(sum2, sum3));
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float total = _mm_cvtss_f32(sum);
+    for (; index < n; index++){
+        total += a[index] * b[index];
+    }
+    return total;
+}
 
-        long long curr_time = time_ms();
-        
-        //grw
-        long long id = (long long)(genid());
-        
-        long long** tmp_timers = realloc(timers, (timers_len + 1) * sizeof(long long*));
-        if (!tmp_timers){
-            printf("Failed memory allocation to grow timers list.\n");
-            return -1;
-        }
-        timers = tmp_timers;
-        timers[timers_len] = malloc(2 * sizeof(long long)); //id, timestamp
+__attribute__((target("avx2")))
+void add_f32_avx2(float* dst, const float* a, const float* b, size_t n){
+    size_t index = 0;
+    for (; index + 8 <= n; index += 8){
+        _mm256_storeu_ps(dst + index, _mm256_add_ps(_mm256_loadu_ps(a + index), _mm256_loadu_ps(b + index)));
+    }
+    for (; index < n; index++){
+        dst[index] = a[index] + b[index];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void layernorm_f32_avx2(float* dst, const float* in, const float* g, const float* b, size_t n){
+    float shift = in[0];
+    __m256 shift8 = _mm256_set1_ps(shift);
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sumsq0 = _mm256_setzero_ps();
+    __m256 sumsq1 = _mm256_setzero_ps();
+    size_t index = 0;
+    for (; index + 16 <= n; index += 16){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(in + index), shift8);
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(in + index + 8), shift8);
+        sum0 = _mm256_add_ps(sum0, d0);
+        sum1 = _mm256_add_ps(sum1, d1);
+        sumsq0 = _mm256_fmadd_ps(d0, d0, sumsq0);
+        sumsq1 = _mm256_fmadd_ps(d1, d1, sumsq1);
+    }
+    for (; index + 8 <= n; index += 8){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(in + index), shift8);
+        sum0 = _mm256_add_ps(sum0, d0);
+        sumsq0 = _mm256_fmadd_ps(d0, d0, sumsq0);
+    }
+    __m256 sum8 = _mm256_add_ps(sum0, sum1);
+    __m256 sumsq8 = _mm256_add_ps(sumsq0, sumsq1);
+    //Both horizontal sums at once, sums in the low half of each lane and squares in the high half.
+    __m256 both = _mm256_hadd_ps(sum8, sumsq8);
+    both = _mm256_hadd_ps(both, both);
+    __m128 halves = _mm_add_ps(_mm256_castps256_ps128(both), _mm256_extractf128_ps(both, 1));
+    float sum = _mm_cvtss_f32(halves);
+    float sumsq = _mm_cvtss_f32(_mm_shuffle_ps(halves, halves, 1));
+    for (; index < n; index++){
+        float d = in[index] - shift;
+        sum += d;
+        sumsq += d * d;
+    }
+    float mean;
+    float rstd;
+    layernorm_stats(sum, sumsq, shift, n, &mean, &rstd);
+    __m256 mean8 = _mm256_set1_ps(mean);
+    __m256 rstd8 = _mm256_set1_ps(rstd);
+    for (index = 0; index + 8 <= n; index += 8){
+        __m256 x_hat = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(in + index), mean8), rstd8);
+        _mm256_storeu_ps(dst + index, _mm256_fmadd_ps(x_hat, _mm256_loadu_ps(g + index), _mm256_loadu_ps(b + index)));
+    }
+    for (; index < n; index++){
+        dst[index] = (in[index] - mean) * rstd * g[index] + b[index];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+__m256 exp_f32_avx2(__m256 x, bool fast){
+    __m256 underflow = _mm256_cmp_ps(x, _mm256_set1_ps(-87.0f), _CMP_LT_OQ);
+    x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(88.0f)), _mm256_set1_ps(-87.0f));
+    __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(EXP_LN2_HI), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(EXP_LN2_LO), r);
+    __m256 p;
+    if (fast){
+        p = _mm256_fmadd_ps(_mm256_set1_ps(0.1654193617f), r, _mm256_set1_ps(0.504949177f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.000186226f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(0.9999289226f));
+    }
+    else{
+        p = _mm256_fmadd_ps(_mm256_set1_ps(1.9875691500e-4f), r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    }
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+    return _mm256_andnot_ps(underflow, _mm256_mul_ps(p, _mm256_castsi256_ps(bits)));
+}
+
+__attribute__((target("avx2,fma")))
+void softmax_f32_avx2(float* dst, const float* in, size_t n, bool fast){
+    __m256 max8 = _mm256_set1_ps(-__FLT_MAX__);
+    size_t index = 0;
+    for (; index + 8 <= n; index += 8){
+        max8 = _mm256_max_ps(max8, _mm256_loadu_ps(in + index));
+    }
+    __m128 max4 = _mm_max_ps(_mm256_castps256_ps128(max8), _mm256_extractf128_ps(max8, 1));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_shuffle_ps(max4, max4, 1));
+    float max = _mm_cvtss_f32(max4);
+    for (; index < n; index++){
+        if (in[index] > max){
+            max = in[index];
+        }
+    }
+
+    max8 = _mm256_set1_ps(max);
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    for (index = 0; index + 16 <= n; index += 16){
+        __m256 e0 = exp_f32_avx2(_mm256_sub_ps(_mm256_loadu_ps(in + index), max8), fast);
+        __m256 e1 = exp_f32_avx2(_mm256_sub_ps(_mm256_loadu_ps(in + index + 8), max8), fast);
+        _mm256_storeu_ps(dst + index, e0);
+        _mm256_storeu_ps(dst + index + 8, e1);
+        sum0 = _mm256_add_ps(sum0, e0);
+        sum1 = _mm256_add_ps(sum1, e1);
+    }
+    for (; index + 8 <= n; index += 8){
+        __m256 e0 = exp_f32_avx2(_mm256_sub_ps(_mm256_loadu_ps(in + index), max8), fast);
+        _mm256_storeu_ps(dst + index, e0);
+        sum0 = _mm256_add_ps(sum0, e0);
+    }
+    __m256 sum8 = _mm256_add_ps(sum0, sum1);
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+    float sum = _mm_cvtss_f32(sum4);
+    for (; index < n; index++){
+        dst[index] = exp_f32(in[index] - max, fast);
+        sum += dst[index];
+    }
+
+    if (sum == 0){
+        for (index = 0; index < n; index++){
+            dst[index] = 1.0f / (float)(n);
+        }
+        return;
+    }
+    __m256 scale8 = _mm256_set1_ps(1.0f / sum);
+    for (index = 0; index + 8 <= n; index += 8){
+        _mm256_storeu_ps(dst + index, _mm256_mul_ps(_mm256_loadu_ps(dst + index), scale8));
+    }
+    for (; index < n; index++){
+        dst[index] *= 1.0f / sum;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void gemm_micro_avx2(int kc, const float* a, const float* b, float* c, size_t ldc, const float* bias, bool accumulate){
+    __m256 acc[GEMM_AVX2_MR][2];
+    #pragma GCC unroll 32
+    for (int row = 0; row < GEMM_AVX2_MR; row++){
+        acc[row][0] = _mm256_setzero_ps();
+        acc[row][1] = _mm256_setzero_ps();
+    }
+    for (int step = 0; step < kc; step++){
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        #pragma GCC unroll 32
+        for (int row = 0; row < GEMM_AVX2_MR; row++){
+            __m256 a_row = _mm256_broadcast_ss(a + row);
+            acc[row][0] = _mm256_fmadd_ps(a_row, b0, acc[row][0]);
+            acc[row][1] = _mm256_fmadd_ps(a_row, b1, acc[row][1]);
+        }
+        a += GEMM_AVX2_MR;
+        b += GEMM_AVX2_NR;
+    }
+    #pragma GCC unroll 32
+    for (int row = 0; row < GEMM_AVX2_MR; row++){
+        float* c_row = c + row * ldc;
+        if (accumulate){
+            acc[row][0] = _mm256_add_ps(acc[row][0], _mm256_loadu_ps(c_row));
+            acc[row][1] = _mm256_add_ps(acc[row][1], _mm256_loadu_ps(c_row + 8));
+        }
+        else{
+            if (bias){
+                acc[row][0] = _mm256_add_ps(acc[row][0], _mm256_loadu_ps(bias));
+                acc[row][1] = _mm256_add_ps(acc[row][1], _mm256_loadu_ps(bias + 8));
+            }
+        }
+        _mm256_storeu_ps(c_row, acc[row][0]);
+        _mm256_storeu_ps(c_row + 8, acc[row][1]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void gemv_f32_avx2(float* y, const float* w, size_t ldw, const float* x, const float* bias, int rows, int cols){
+    int row = 0;
+    for (; row + GEMV_ROWS <= rows; row += GEMV_ROWS){
+        const float* w0 = w + (size_t)(row) * ldw;
+        const float* w1 = w0 + ldw;
+        const float* w2 = w1 + ldw;
+        const float* w3 = w2 + ldw;
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        __m256 sum3 = _mm256_setzero_ps();
+        int col = 0;
+        for (; col + 8 <= cols; col += 8){
+            if ((col & 15) == 0){
+                _mm_prefetch((const char*)(w0 + col + GEMV_PREFETCH), _MM_HINT_T0);
+                _mm_prefetch((const char*)(w1 + col + GEMV_PREFETCH), _MM_HINT_T0);
+                _mm_prefetch((const char*)(w2 + col + GEMV_PREFETCH), _MM_HINT_T0);
+                _mm_prefetch((const char*)(w3 + col + GEMV_PREFETCH), _MM_HINT_T0);
+            }
+            __m256 x8 = _mm256_loadu_ps(x + col);
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + col), x8, sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + col), x8, sum1);
+            sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + col), x8, sum2);
+            sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + col), x8, sum3);
+        }
+        //Lane i of sums ends up as the total of sum<i>.
+        __m256 pairs = _mm256_hadd_ps(_mm256_hadd_ps(sum0, sum1), _mm256_hadd_ps(sum2, sum3));
+        __m128 sums = _mm_add_ps(_mm256_castps256_ps128(pairs), _mm256_extractf128_ps(pairs, 1));
+        if (bias){
+            sums = _mm_add_ps(sums, _mm_loadu_ps(bias + row));
+        }
+        _mm_storeu_ps(y + row, sums);
+        for (; col < cols; col++){
+            y[row] += w0[col] * x[col];
+            y[row + 1] += w1[col] * x[col];
+            y[row + 2] += w2[col] * x[col];
+            y[row + 3] += w3[col] * x[col];
+        }
+    }
+    for (; row < rows; row++){
+        y[row] = dot_f32_avx2(w + (size_t)(row) * ldw, x, cols) + (bias ? bias[row] : 0);
+    }
+}
+
+__attribute__((target("avx512f")))
+float dot_f32_avx512(const float* a, const float* b, size_t n){
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    __m512 sum2 = _mm512_setzero_ps();
+    __m512 sum3 = _mm512_setzero_ps();
+    size_t index = 0;
+    for (; index + 64 <= n; index += 64){
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + index), _mm512_loadu_ps(b + index), sum0);
+        sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + index + 16), _mm512_loadu_ps(b + index + 16), sum1);
+        sum2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + index + 32), _mm512_loadu_ps(b + index + 32), sum2);
+        sum3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + index + 48), _mm512_loadu_ps(b + index + 48), sum3);
+    }
+    for (; index + 16 <= n; index += 16){
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + index), _mm512_loadu_ps(b + index), sum0);
+    }
+    if (index < n){
+        //The last few floats are loaded masked, nothing past the end is touched.
+        __mmask16 mask = (__mmask16)((1u << (n - index)) - 1);
+        sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + index), _mm512_maskz_loadu_ps(mask, b + index), sum1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(sum0, sum1), _mm512_add_ps(sum2, sum3)));
+}
+
+__attribute__((target("avx512f")))
+void add_f32_avx512(float* dst, const float* a, const float* b, size_t n){
+    size_t index = 0;
+    for (; index + 16 <= n; index += 16){
+        _mm512_storeu_ps(dst + index, _mm512_add_ps(_mm512_loadu_ps(a + index), _mm512_loadu_ps(b + index)));
+    }
+    if (index < n){
+        __mmask16 mask = (__mmask16)((1u << (n - index)) - 1);
+        _mm512_mask_storeu_ps(dst + index, mask, _mm512_add_ps(_mm512_maskz_loadu_ps(mask, a + index), _mm512_maskz_loadu_ps(mask, b + index)));
+    }
+}
+
+__attribute__((target("avx512f")))
+void layernorm_f32_avx512(float* dst, const float* in, const float* g, const float* b, size_t n){
+    float shift = in[0];
+    __m512 shift16 = _mm512_set1_ps(shift);
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    __m512 sumsq0 = _mm512_setzero_ps();
+    __m512 sumsq1 = _mm512_setzero_ps();
+    size_t index = 0;
+    for (; index + 32 <= n; index += 32){
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(in + index), shift16);
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(in + index + 16), shift16);
+        sum0 = _mm512_add_ps(sum0, d0);
+        sum1 = _mm512_add_ps(sum1, d1);
+        sumsq0 = _mm512_fmadd_ps(d0, d0, sumsq0);
+        sumsq1 = _mm512_fmadd_ps(d1, d1, sumsq1);
+    }
+    for (; index < n; index += 16){
+        //Masked lanes load as the shift so they add nothing.
+        __mmask16 mask = (n - index >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - index)) - 1);
+        __m512 d0 = _mm512_sub_ps(_mm512_mask_loadu_ps(shift16, mask, in + index), shift16);
+        sum0 = _mm512_add_ps(sum0, d0);
+        sumsq0 = _mm512_fmadd_ps(d0, d0, sumsq0);
+    }
+    float mean;
+    float rstd;
+    layernorm_stats(_mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1)), _mm512_reduce_add_ps(_mm512_add_ps(sumsq0, sumsq1)), shift, n, &mean, &rstd);
+    __m512 mean16 = _mm512_set1_ps(mean);
+    __m512 rstd16 = _mm512_set1_ps(rstd);
+    for (index = 0; index < n; index += 16){
+        __mmask16 mask = (n - index >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - index)) - 1);
+        __m512 x_hat = _mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, in + index), mean16), rstd16);
+        _mm512_mask_storeu_ps(dst + index, mask, _mm512_fmadd_ps(x_hat, _mm512_maskz_loadu_ps(mask, g + index), _mm512_maskz_loadu_ps(mask, b + index)));
+    }
+}
+
+__attribute__((target("avx512f")))
+__m512 exp_f32_avx512(__m512 x, bool fast){
+    __mmask16 keep = _mm512_cmp_ps_mask(x, _mm512_set1_ps(-87.0f), _CMP_GE_OQ);
+    x = _mm512_min_ps(x, _mm512_set1_ps(88.0f));
+    __m512 k = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(k, _mm512_set1_ps(EXP_LN2_HI), x);
+    r = _mm512_fnmadd_ps(k, _mm512_set1_ps(EXP_LN2_LO), r);
+    __m512 p;
+    if (fast){
+        p = _mm512_fmadd_ps(_mm512_set1_ps(0.1654193617f), r, _mm512_set1_ps(0.504949177f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.000186226f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(0.9999289226f));
+    }
+    else{
+        p = _mm512_fmadd_ps(_mm512_set1_ps(1.9875691500e-4f), r, _mm512_set1_ps(1.3981999507e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+        p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    }
+    return _mm512_maskz_mov_ps(keep, _mm512_scalef_ps(p, k));
+}
+
+__attribute__((target("avx512f")))
+void softmax_f32_avx512(float* dst, const float* in, size_t n, bool fast){
+    __m512 lowest = _mm512_set1_ps(-__FLT_MAX__);
+    __m512 max16 = lowest;
+    for (size_t index = 0; index < n; index += 16){
+        __mmask16 mask = (n - index >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - index)) - 1);
+        max16 = _mm512_max_ps(max16, _mm512_mask_loadu_ps(lowest, mask, in + index));
+    }
+    __m512 max = _mm512_set1_ps(_mm512_reduce_max_ps(max16));
+
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    size_t index = 0;
+    for (; index + 32 <= n; index += 32){
+        __m512 e0 = exp_f32_avx512(_mm512_sub_ps(_mm512_loadu_ps(in + index), max), fast);
+        __m512 e1 = exp_f32_avx512(_mm512_sub_ps(_mm512_loadu_ps(in + index + 16), max), fast);
+        _mm512_storeu_ps(dst + index, e0);
+        _mm512_storeu_ps(dst + index + 16, e1);
+        sum0 = _mm512_add_ps(sum0, e0);
+        sum1 = _mm512_add_ps(sum1, e1);
+    }
+    for (; index < n; index += 16){
+        __mmask16 mask = (n - index >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - index)) - 1);
+        __m512 e0 = _mm512_maskz_mov_ps(mask, exp_f32_avx512(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, in + index), max), fast));
+        _mm512_mask_storeu_ps(dst + index, mask, e0);
+        sum0 = _mm512_add_ps(sum0, e0);
+    }
+    float sum = _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+
+    if (sum == 0){
+        for (index = 0; index < n; index++){
+            dst[index] = 1.0f / (float)(n);
+        }
+        return;
+    }
+    __m512 scale = _mm512_set1_ps(1.0f / sum);
+    for (index = 0; index < n; index += 16){
+        __mmask16 mask = (n - index >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - index)) - 1);
+        _mm512_mask_storeu_ps(dst + index, mask, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, dst + index), scale));
+    }
+}
+
+__attribute__((target("avx512f")))
+void gemm_micro_avx512(int kc, const float* a, const float* b, float* c, size_t ldc, const float* bias, bool accumulate){
+    __m512 acc[GEMM_AVX512_MR][2];
+    #pragma GCC unroll 32
+    for (int row = 0; row < GEMM_AVX512_MR; row++){
+        acc[row][0] = _mm512_setzero_ps();
+        acc[row][1] = _mm512_setzero_ps();
+    }
+    for (int step = 0; step < kc; step++){
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        #pragma GCC unroll 32
+        for (int row = 0; row < GEMM_AVX512_MR; row++){
+            __m512 a_row = _mm512_set1_ps(a[row]);
+            acc[row][0] = _mm512_fmadd_ps(a_row, b0, acc[row][0]);
+            acc[row][1] = _mm512_fmadd_ps(a_row, b1, acc[row][1]);
+        }
+        a += GEMM_AVX512_MR;
+        b += GEMM_AVX512_NR;
+    }
+    #pragma GCC unroll 32
+    for (int row = 0; row < GEMM_AVX512_MR; row++){
+        float* c_row = c + row * ldc;
+        if (accumulate){
+            acc[row][0] = _mm512_add_ps(acc[row][0], _mm512_loadu_ps(c_row));
+            acc[row][1] = _mm512_add_ps(acc[row][1], _mm512_loadu_ps(c_row + 16));
+        }
+        else{
+            if (bias){
+                acc[row][0] = _mm512_add_ps(acc[row][0], _mm512_loadu_ps(bias));
+                acc[row][1] = _mm512_add_ps(acc[row][1], _mm512_loadu_ps(bias + 16));
+            }
+        }
+        _mm512_storeu_ps(c_row, acc[row][0]);
+        _mm512_storeu_ps(c_row + 16, acc[row][1]);
+    }
+}
+
+__attribute__((target("avx512f")))
+void gemv_f32_avx512(float* y, const float* w, size_t ldw, const float* x, const float* bias, int rows, int cols){
+    int row = 0;
+    for (; row + GEMV_ROWS <= rows; row += GEMV_ROWS){
+        const float* w0 = w + (size_t)(row) * ldw;
+        const float* w1 = w0 + ldw;
+        const float* w2 = w1 + ldw;
+        const float* w3 = w2 + ldw;
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        __m512 sum3 = _mm512_setzero_ps();
+        for (int col = 0; col < cols; col += 16){
+            __mmask16 mask = (cols - col >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (cols - col)) - 1);
+            _mm_prefetch((const char*)(w0 + col + GEMV_PREFETCH), _MM_HINT_T0);
+            _mm_prefetch((const char*)(w1 + col + GEMV_PREFETCH), _MM_HINT_T0);
+            _mm_prefetch((const char*)(w2 + col + GEMV_PREFETCH), _MM_HINT_T0);
+            _mm_prefetch((const char*)(w3 + col + GEMV_PREFETCH), _MM_HINT_T0);
+            __m512 x16 = _mm512_maskz_loadu_ps(mask, x + col);
+            sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, w0 + col), x16, sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, w1 + col), x16, sum1);
+            sum2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, w2 + col), x16, sum2);
+            sum3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, w3 + col), x16, sum3);
+        }
+        y[row] = _mm512_reduce_add_ps(sum0) + (bias ? bias[row] : 0);
+        y[row + 1] = _mm512_reduce_add_ps(sum1) + (bias ? bias[row + 1] : 0);
+        y[row + 2] = _mm512_reduce_add_ps(sum2) + (bias ? bias[row + 2] : 0);
+        y[row + 3] = _mm512_reduce_add_ps(sum3) + (bias ? bias[row + 3] : 0);
+    }
+    for (; row < rows; row++){
+        y[row] = dot_f32_avx512(w + (size_t)(row) * ldw, x, cols) + (bias ? bias[row] : 0);
+    }
+}
+#endif
+
+float (*dot_kernel)(const float* a, const float* b, size_t n) = dot_f32_scalar;
+void (*add_kernel)(float* dst, const float* a, const float* b, size_t n) = add_f32_scalar;
+void (*layernorm_kernel)(float* dst, const float* in, const float* g, const float* b, size_t n) = layernorm_f32_scalar; //no SSE2 one, the scalar loop is close enough there
+void (*softmax_kernel)(float* dst, const float* in, size_t n, bool fast) = softmax_f32_scalar; //same
+void (*gemm_kernel)(int kc, const float* a, const float* b, float* c, size_t ldc, const float* bias, bool accumulate) = gemm_micro_scalar; //same
+int gemm_mr = GEMM_SCALAR_MR;
+int gemm_nr = GEMM_SCALAR_NR;
+void (*gemv_kernel)(float* y, const float* w, size_t ldw, const float* x, const float* bias, int rows, int cols) = gemv_f32_scalar; //same
+const char* kernel_name = "scalar";
+
+void select_kernels(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        dot_kernel = dot_f32_avx512;
+        add_kernel = add_f32_avx512;
+        layernorm_kernel = layernorm_f32_avx512;
+        softmax_kernel = softmax_f32_avx512;
+        gemm_kernel = gemm_micro_avx512;
+        gemm_mr = GEMM_AVX512_MR;
+        gemm_nr = GEMM_AVX512_NR;
+        gemv_kernel = gemv_f32_avx512;
+        kernel_name = "AVX-512";
+    }
+    else{
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+            dot_kernel = dot_f32_avx2;
+            add_kernel = add_f32_avx2;
+            layernorm_kernel = layernorm_f32_avx2;
+            softmax_kernel = softmax_f32_avx2;
+            gemm_kernel = gemm_micro_avx2;
+            gemm_mr = GEMM_AVX2_MR;
+            gemm_nr = GEMM_AVX2_NR;
+            gemv_kernel = gemv_f32_avx2;
+            kernel_name = "AVX2";
+        }
+        else{
+            if (__builtin_cpu_supports("sse2")){
+                dot_kernel = dot_f32_sse2;
+                add_kernel = add_f32_sse2;
+                kernel_name = "SSE2";
+            }
+        }
+    }
+#endif
+}
+
+//C[m x n] = op(A)[m x k] * op(B)[k x n], op() transposing when trans_ is set. With accumulate the product is added to C,
+//otherwise C is overwritten and bias[n] (if any) is added to every row. Model weights are [out x in] with one row per
+//output, so projecting rows of activations is sgemm(false, true, tokens, out, in, x, in, w, in, bias, y, out, false).
+//
+//Blocked the usual way: a KC deep slice of op(B), NC columns wide, is packed into NR wide panels that stay in L3/L2,
+//an MC x KC block of op(A) is packed into MR tall panels that stay in L2, and the micro-kernel streams one B panel
+//through L1 per MR x NR tile of C. Packing also takes care of transposes and zero pads the edges.
+#define GEMM_MC 96 //multiple of every MR
+#define GEMM_KC 256
+#define GEMM_NC 2048 //multiple of every NR
+#define GEMM_MAX_TILE (GEMM_AVX512_MR * GEMM_AVX512_NR)
+
+__thread float* gemm_pack = NULL; //per thread, MC x KC of A followed by KC x NC of B
+
+void gemm_pack_a(float* dst, const float* a, size_t lda, bool trans_a, int i0, int mc, int p0, int kc){
+    for (int panel = 0; panel < mc; panel += gemm_mr){
+        int rows = (mc - panel < gemm_mr) ? mc - panel : gemm_mr;
+        for (int step = 0; step < kc; step++){
+            for (int row = 0; row < gemm_mr; row++){
+                float value = 0;
+                if (row < rows){
+                    size_t i = (size_t)(i0 + panel + row);
+                    size_t p = (size_t)(p0 + step);
+                    value = trans_a ? a[p * lda + i] : a[i * lda + p];
+                }
+                *dst++ = value;
+            }
+        }
+    }
+}
+
+void gemm_pack_b(float* dst, const float* b, size_t ldb, bool trans_b, int j0, int nc, int p0, int kc){
+    for (int panel = 0; panel < nc; panel += gemm_nr){
+        int cols = (nc - panel < gemm_nr) ? nc - panel : gemm_nr;
+        if (trans_b){
+            //Rows of b are the columns we want, read each one straight through.
+            for (int col = 0; col < gemm_nr; col++){
+                const float* src = b + (size_t)(j0 + panel + col) * ldb + p0;
+                for (int step = 0; step < kc; step++){
+                    dst[step * gemm_nr + col] = (col < cols) ? src[step] : 0;
+                }
+            }
+        }
+        else{
+            for (int step = 0; step < kc; step++){
+                const float* src = b + (size_t)(p0 + step) * ldb + j0 + panel;
+                for (int col = 0; col < gemm_nr; col++){
+                    dst[step * gemm_nr + col] = (col < cols) ? src[col] : 0;
+                }
+            }
+        }
+        dst += (size_t)(kc) * gemm_nr;
+    }
+}
+
+void sgemm(bool trans_a, bool trans_b, int m, int n, int k, const float* a, size_t lda, const float* b, size_t ldb, const float* bias, float* c, size_t ldc, bool accumulate){
+    if (m < 1 || n < 1){
+        return;
+    }
+    if (k < 1){
+        if (!accumulate){
+            for (int row = 0; row < m; row++){
+                for (int col = 0; col < n; col++){
+                    c[(size_t)(row) * ldc + col] = bias ? bias[col] : 0;
+                }
+            }
+        }
+        return;
+    }
+    if (!gemm_pack){
+        //Kept for the thread's lifetime, like its workspace.
+        char* raw = malloc(((size_t)(GEMM_MC) * GEMM_KC + (size_t)(GEMM_KC) * GEMM_NC) * sizeof(float) + 63);
+        if (!raw){
+            printf("Failed to allocate memory for matrix multiplication.\n");
+            exit(1);
+        }
+        gemm_pack = (float*)(((uintptr_t)(raw) + 63) & ~(uintptr_t)(63));
+    }
+    float* packed_a = gemm_pack;
+    float* packed_b = gemm_pack + (size_t)(GEMM_MC) * GEMM_KC;
+    float edge[GEMM_MAX_TILE] __attribute__((aligned(64)));
+    float edge_bias[GEMM_AVX512_NR] __attribute__((aligned(64)));
+
+    for (int j0 = 0; j0 < n; j0 += GEMM_NC){
+        int nc = (n - j0 < GEMM_NC) ? n - j0 : GEMM_NC;
+        for (int p0 = 0; p0 < k; p0 += GEMM_KC){
+            int kc = (k - p0 < GEMM_KC) ? k - p0 : GEMM_KC;
+            //Only the first slice of k sees C as it was, the others add on top of what it left.
+            bool add_to_c = accumulate || p0 > 0;
+            gemm_pack_b(packed_b, b, ldb, trans_b, j0, nc, p0, kc);
+            for (int i0 = 0; i0 < m; i0 += GEMM_MC){
+                int mc = (m - i0 < GEMM_MC) ? m - i0 : GEMM_MC;
+                gemm_pack_a(packed_a, a, lda, trans_a, i0, mc, p0, kc);
+                for (int jr = 0; jr < nc; jr += gemm_nr){
+                    int cols = (nc - jr < gemm_nr) ? nc - jr : gemm_nr;
+                    const float* panel_b = packed_b + (size_t)(jr / gemm_nr) * kc * gemm_nr;
+                    const float* tile_bias = (bias && !add_to_c) ? bias + j0 + jr : NULL;
+                    if (tile_bias && cols < gemm_nr){
+                        memset(edge_bias, 0, sizeof(edge_bias));
+                        memcpy(edge_bias, tile_bias, (size_t)(cols) * sizeof(float));
+                        tile_bias = edge_bias;
+                    }
+                    for (int ir = 0; ir < mc; ir += gemm_mr){
+                        int rows = (mc - ir < gemm_mr) ? mc - ir : gemm_mr;
+                        const float* panel_a = packed_a + (size_t)(ir / gemm_mr) * kc * gemm_mr;
+                        float* tile = c + (size_t)(i0 + ir) * ldc + j0 + jr;
+                        if (rows == gemm_mr && cols == gemm_nr){
+                            gemm_kernel(kc, panel_a, panel_b, tile, ldc, tile_bias, add_to_c);
+                            continue;
+                        }
+                        //Partial tile, run the full one on a scratch copy and only write back what's inside C.
+                        for (int row = 0; row < rows && add_to_c; row++){
+                            memcpy(edge + row * gemm_nr, tile + (size_t)(row) * ldc, (size_t)(cols) * sizeof(float));
+                        }
+                        gemm_kernel(kc, panel_a, panel_b, edge, gemm_nr, tile_bias, add_to_c);
+                        for (int row = 0; row < rows; row++){
+                            memcpy(tile + (size_t)(row) * ldc, edge + row * gemm_nr, (size_t)(cols) * sizeof(float));
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+//y[rows] = w[rows x cols] * x + bias, the one token case of a projection that sgemm() would spend packing on. Big enough
+//matrices are split by output row across a pool of gemv_threads - 1 threads plus the caller, the more cores reading the
+//more of the memory bandwidth gets used. The pool is started on first use and then sleeps between calls, so a decode
+//step doesn't pay for creating threads. Chunks end on 64 byte boundaries of y so no two threads write the same cache line.
+#define GEMV_THREADED_MIN (256 * 1024) //floats of w, below that waking the pool costs more than it saves
+int gemv_threads = 1;
+
+typedef struct {
+    float* y;
+    const float* w;
+    size_t ldw;
+    const float* x;
+    const float* bias;
+    int rows;
+    int cols;
+} gemv_job;
+
+typedef struct {
+    gemv_job* jobs; //the caller's, valid until pending is back to 0
+    int jobs_len;
+    int next; //first job nobody took yet
+    int pending; //jobs not finished yet
+    unsigned long generation; //bumped for every call so sleeping threads know there is work
+    int threads; //started, the caller not included
+    bool forks_handled; //atfork handler registered, stays set in children
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} gemv_pool_state;
+
+gemv_pool_state gemv_pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+pthread_mutex_t gemv_dispatch = PTHREAD_MUTEX_INITIALIZER; //one sgemv on the pool at a time, held from publishing the jobs until they're all done
+__thread bool gemv_in_pool = false; //set on the pool's own threads, they run sgemv single threaded instead of waiting on themselves
+
+//Runs jobs until there are none left to take, called with the lock held and returns with it held.
+void gemv_take_jobs(){
+    while (gemv_pool.next < gemv_pool.jobs_len){
+        gemv_job* job = &gemv_pool.jobs[gemv_pool.next++];
+        pthread_mutex_unlock(&gemv_pool.lock);
+        gemv_kernel(job->y, job->w, job->ldw, job->x, job->bias, job->rows, job->cols);
+        pthread_mutex_lock(&gemv_pool.lock);
+        gemv_pool.pending--;
+        if (gemv_pool.pending == 0){
+            pthread_cond_signal(&gemv_pool.done);
+        }
+    }
+}
+
+void* gemv_worker(void* arg){
+    (void)arg;
+    gemv_in_pool = true;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&gemv_pool.lock);
+    while (true){
+        while (gemv_pool.generation == seen){
+            pthread_cond_wait(&gemv_pool.work, &gemv_pool.lock);
+        }
+        seen = gemv_pool.generation;
+        gemv_take_jobs();
+    }
+    return NULL;
+}
+
+#ifndef _WIN32
+//fork() holds gemv_dispatch so no call is in flight, but a pool thread may still own the lock for a moment
+//and the child gets none of the threads. It starts from a fresh pool and builds its own if it needs one.
+void gemv_fork_prepare(){
+    pthread_mutex_lock(&gemv_dispatch);
+}
+
+void gemv_fork_parent(){
+    pthread_mutex_unlock(&gemv_dispatch);
+}
+
+void gemv_fork_child(){
+    pthread_mutex_init(&gemv_dispatch, NULL);
+    pthread_mutex_init(&gemv_pool.lock, NULL);
+    pthread_cond_init(&gemv_pool.work, NULL);
+    pthread_cond_init(&gemv_pool.done, NULL);
+    gemv_pool.threads = 0;
+    gemv_pool.generation = 0;
+    gemv_pool.jobs_len = 0;
+    gemv_pool.next = 0;
+    gemv_pool.pending = 0;
+}
+#endif
+
+//Starts the pool's threads if this process doesn't have them yet, how many it got. Called with gemv_dispatch held.
+int gemv_start_pool(){
+    if ((gemv_pool.threads > 0) || (gemv_threads <= 1)){
+        return gemv_pool.threads;
+    }
+#ifndef _WIN32
+    if (!gemv_pool.forks_handled){
+        if (pthread_atfork(gemv_fork_prepare, gemv_fork_parent, gemv_fork_child) != 0){
+            return 0; //a child could inherit a held lock, stay single threaded
+        }
+        gemv_pool.forks_handled = true;
+    }
+#endif
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int index = 0; index < gemv_threads - 1; index++){
+        pthread_t worker;
+        if (pthread_create(&worker, &attr, gemv_worker, NULL) != 0){
+            break;
+        }
+        gemv_pool.threads++;
+    }
+    pthread_attr_destroy(&attr);
+    return gemv_pool.threads;
+}
+
+void sgemv(float* y, const float* w, size_t ldw, const float* x, const float* bias, int rows, int cols){
+    if (rows < 1){
+        return;
+    }
+    int threads = 1;
+    bool pooled = ((size_t)(rows) * cols >= GEMV_THREADED_MIN) && (gemv_threads > 1) && !gemv_in_pool;
+    if (pooled){
+        pthread_mutex_lock(&gemv_dispatch);
+        threads = gemv_start_pool() + 1;
+    }
+    if (rows < threads * 16){
+        threads = rows / 16;
+    }
+    if (threads <= 1){
+        if (pooled){
+            pthread_mutex_unlock(&gemv_dispatch);
+        }
+        gemv_kernel(y, w, ldw, x, bias, rows, cols);
+        return;
+    }
+    gemv_job jobs[threads];
+    int jobs_len = 0;
+    int chunk = (rows + threads - 1) / threads;
+    int misalign = (int)(((uintptr_t)(y) / sizeof(float)) % 16); //floats y is past the last cache line boundary
+    for (int first = 0; first < rows; ){
+        int end = first + chunk;
+        end -= (misalign + end) % 16; //back to a cache line boundary, still past first as chunk >= 16
+        if ((end > rows) || (jobs_len == threads - 1)){
+            end = rows;
+        }
+        gemv_job* job = &jobs[jobs_len++];
+        job->y = y + first;
+        job->w = w + (size_t)(first) * ldw;
+        job->ldw = ldw;
+        job->x = x;
+        job->bias = bias ? bias + first : NULL;
+        job->rows = end - first;
+        job->cols = cols;
+        first = end;
+    }
+
+    pthread_mutex_lock(&gemv_pool.lock);
+    gemv_pool.jobs = jobs;
+    gemv_pool.jobs_len = jobs_len;
+    gemv_pool.next = 0;
+    gemv_pool.pending = jobs_len;
+    gemv_pool.generation++;
+    pthread_cond_broadcast(&gemv_pool.work);
+    gemv_take_jobs();
+    while (gemv_pool.pending > 0){
+        pthread_cond_wait(&gemv_pool.done, &gemv_pool.lock);
+    }
+    gemv_pool.jobs_len = 0;
+    pthread_mutex_unlock(&gemv_pool.lock);
+    pthread_mutex_unlock(&gemv_dispatch);
+}
+
+//Checkpoint filters. Shuffling stores byte 0 of every float, then byte 1 and so on, exponent bytes end up
+//together and deflate finds a lot more to work with. XOR against the previous checkpoint zeroes whatever didn't change.
+void shuffle_bytes(void* dst, const void* src, size_t count){
+    const unsigned char* in = src;
+    unsigned char* out = dst;
+    for (size_t index = 0; index < count; index++){
+        out[index] = in[index * 4];
+        out[count + index] = in[index * 4 + 1];
+        out[count * 2 + index] = in[index * 4 + 2];
+        out[count * 3 + index] = in[index * 4 + 3];
+    }
+}
+
+void unshuffle_bytes(void* dst, const void* src, size_t count){
+    const unsigned char* in = src;
+    unsigned char* out = dst;
+    for (size_t index = 0; index < count; index++){
+        out[index * 4] = in[index];
+        out[index * 4 + 1] = in[count + index];
+        out[index * 4 + 2] = in[count * 2 + index];
+        out[index * 4 + 3] = in[count * 3 + index];
+    }
+}
+
+void xor_floats(void* dst, const void* src, const void* ref, size_t count){
+    const uint32_t* in = src;
+    const uint32_t* with = ref;
+    uint32_t* out = dst;
+    for (size_t index = 0; index < count; index++){
+        out[index] = in[index] ^ with[index];
+    }
+}
+
+//Growable output buffer for the checkpoint metadata and tensor index, failed sticks so callers only check once at the end.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} out_buffer;
+
+bool buf_reserve(out_buffer* buf, size_t more){
+    if (buf->failed){
+        return false;
+    }
+    if (buf->len + more < buf->cap){
+        return true;
+    }
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap <= buf->len + more){
+        cap *= 2;
+    }
+    char* tmp = realloc(buf->data, cap);
+    if (!tmp){
+        buf->failed = true;
+        return false;
+    }
+    buf->data = tmp;
+    buf->cap = cap;
+    return true;
+}
+
+void buf_append(out_buffer* buf, const void* data, size_t len){
+    if (buf_reserve(buf, len)){
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+}
+
+void buf_printf(out_buffer* buf, const char* fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    va_list ap1; va_copy(ap1, ap);
+    int needed = vsnprintf(NULL, 0, fmt, ap1);
+    va_end(ap1);
+    if (needed < 0){
+        buf->failed = true;
+    }
+    else{
+        if (buf_reserve(buf, needed + 1)){
+            vsnprintf(buf->data + buf->len, needed + 1, fmt, ap);
+            buf->len += needed;
+        }
+    }
+    va_end(ap);
+}
+
+//Quoted and escaped JSON string.
+void buf_json_string(out_buffer* buf, const char* str){
+    buf_append(buf, "\"", 1);
+    for (; *str; str++){
+        unsigned char chr = *str;
+        if (chr == '"' || chr == '\\'){
+            buf_printf(buf, "\\%c", chr);
+        }
+        else{
+            if (chr < 0x20){
+                buf_printf(buf, "\\u%04x", chr);
+            }
+            else{
+                buf_append(buf, str, 1);
+            }
+        }
+    }
+    buf_append(buf, "\"", 1);
+}
+
+//tensors.idx, written next to model_meta.json: this header then per entry a uint64 offset in the values plane,
+//a uint64 float count, a uint16 name length and the name. Loaders whose layout hashes the same skip the JSON paths.
+#define TENSOR_INDEX_MAGIC "CAITIDX1"
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t layout_hash;
+    uint64_t plane_size;
+} tensor_index_header;
+
+//save() deflates tensors on every core and writes them into the zip in order as they finish.
+typedef struct {
+    char* path;
+    const void* parts[3]; //value, adam m and adam v planes, stored back to back
+    const void* refs[3]; //same planes in the previous checkpoint to XOR against, NULL if not
+    void* owned; //freed once written, for parts gathered just for this job
+    int planes; //3, or 1 for values only
+    bool shuffle;
+    size_t part_size; //in bytes
+    void* data; //deflated
+    size_t data_size;
+    size_t capacity;
+    mz_uint32 crc;
+    bool done;
+    bool ok;
+} deflate_job;
+
+typedef struct {
+    deflate_job* jobs;
+    int jobs_len;
+    int next; //first job no worker took yet
+    int written; //jobs before this one are in the zip and freed
+    int window; //how far workers may run ahead of the writer, bounds memory use
+    mz_uint comp_flags;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} deflate_queue;
+
+//Stored (level 0) entries are streamed straight out of the planes, no staging copy and no compressor.
+size_t read_planes(void* opaque, mz_uint64 offset, void* buf, size_t n){
+    deflate_job* job = opaque;
+    size_t done = 0;
+    while ((done < n) && (offset < job->part_size * job->planes)){
+        size_t plane = offset / job->part_size;
+        size_t at = offset % job->part_size;
+        size_t run = job->part_size - at;
+        if (run > n - done){
+            run = n - done;
+        }
+        memcpy((char*)buf + done, (const char*)(job->parts[plane]) + at, run);
+        done += run;
+        offset += run;
+    }
+    return done;
+}
+
+//Checkpoint compression names (config and --checkpoint-compression) to miniz levels, -1 if unknown.
+int compression_level(const char* name){
+    if (strcmp(name, "store") == 0) return MZ_NO_COMPRESSION;
+    if (strcmp(name, "fast") == 0) return MZ_BEST_SPEED;
+    if (strcmp(name, "default") == 0) return MZ_DEFAULT_LEVEL;
+    if (strcmp(name, "best") == 0) return MZ_BEST_COMPRESSION;
+    return -1;
+}
+
+//Whether a and b name the same existing file, so a checkpoint is never XORed against the file it replaces.
+bool same_file(const char* a, const char* b){
+#ifdef _WIN32
+    char full_a[MAX_PATH];
+    char full_b[MAX_PATH];
+    if (!_fullpath(full_a, a, MAX_PATH) || !_fullpath(full_b, b, MAX_PATH)){
+        return strcmp(a, b) == 0;
+    }
+    return _stricmp(full_a, full_b) == 0;
+#else
+    struct stat st_a;
+    struct stat st_b;
+    if ((stat(a, &st_a) != 0) || (stat(b, &st_b) != 0)){
+        return strcmp(a, b) == 0;
+    }
+    return (st_a.st_dev == st_b.st_dev) && (st_a.st_ino == st_b.st_ino);
+#endif
+}
+
+bool path_separator(char c){
+#ifdef _WIN32
+    return (c == '/') || (c == '\\');
+#else
+    return c == '/';
+#endif
+}
+
+bool absolute_path(const char* path){
+#ifdef _WIN32
+    return path_separator(path[0]) || (isalpha((unsigned char)(path[0])) && (path[1] == ':'));
+#else
+    return path[0] == '/';
+#endif
+}
+
+//Length of the directory part of path, separator included, 0 if it is just a file name.
+size_t dir_len(const char* path){
+    size_t len = 0;
+    for (size_t index = 0; path[index]; index++){
+        if (path_separator(path[index])){
+            len = index + 1;
+        }
+    }
+    return len;
+}
+
+//Absolute, resolved form of path (which has to exist), NULL if it can't be had. Free it.
+char* full_path(const char* path){
+#ifdef _WIN32
+    return _fullpath(NULL, path, 0);
+#else
+    return realpath(path, NULL);
+#endif
+}
+
+//Checkpoints name their base relative to their own directory so the pair can be moved or loaded from anywhere.
+//Gives target (an existing file) as seen from the directory checkpoint is in, target as is if that can't be worked out.
+char* path_relative_to(const char* target, const char* checkpoint){
+    size_t checkpoint_dir_len = dir_len(checkpoint);
+    char checkpoint_dir[checkpoint_dir_len + 2];
+    memcpy(checkpoint_dir, checkpoint, checkpoint_dir_len);
+    strcpy(checkpoint_dir + checkpoint_dir_len, "."); //"d1/." or "."
+    char* full_target = full_path(target);
+    char* full_dir = full_path(checkpoint_dir);
+    char* returns = NULL;
+    if (full_target && full_dir){
+        //Longest run of whole directories both share.
+        size_t common = 0;
+        size_t index = 0;
+#ifdef _WIN32
+        while (full_target[index] && (tolower((unsigned char)(full_target[index])) == tolower((unsigned char)(full_dir[index])))){
+#else
+        while (full_target[index] && (full_target[index] == full_dir[index])){
+#endif
+            if (path_separator(full_target[index])){
+                common = index + 1;
+            }
+            index++;
+        }
+        if ((full_dir[index] == '\0') && path_separator(full_target[index])){
+            common = index + 1;
+        }
+        if (common == 0){
+            //Nothing in common (another drive), only the absolute path works.
+            returns = malloc(strlen(full_target) + 1);
+            if (returns){
+                strcpy(returns, full_target);
+            }
+        }
+        else{
+            int ups = 0;
+            const char* rest = full_dir + common;
+            if (*rest){
+                ups = 1;
+                for (; *rest; rest++){
+                    if (path_separator(*rest) && rest[1]){
+                        ups++;
+                    }
+                }
+            }
+            returns = malloc(ups * 3 + strlen(full_target + common) + 1);
+            if (returns){
+                returns[0] = '\0';
+                for (int up = 0; up < ups; up++){
+                    strcat(returns, "../");
+                }
+                strcat(returns, full_target + common);
+            }
+        }
+    }
+    free(full_target);
+    free(full_dir);
+    if (!returns){
+        returns = malloc(strlen(target) + 1);
+        if (returns){
+            strcpy(returns, target);
+        }
+    }
+    return returns;
+}
+
+//Undoes path_relative_to(), base being what the checkpoint at path checkpoint recorded. Checkpoints from before
+//base paths were relative to the checkpoint had them relative to wherever they were saved from instead,
+//that is used when it is the only one that exists.
+char* resolve_base_path(const char* base, const char* checkpoint){
+    size_t prefix = absolute_path(base) ? 0 : dir_len(checkpoint);
+    char* returns = malloc(prefix + strlen(base) + 1);
+    if (!returns){
+        return NULL;
+    }
+    memcpy(returns, checkpoint, prefix);
+    strcpy(returns + prefix, base);
+    if (prefix){
+        FILE* probe = fopen(returns, "rb");
+        if (probe){
+            fclose(probe);
+        }
+        else{
+            probe = fopen(base, "rb");
+            if (probe){
+                fclose(probe);
+                strcpy(returns, base);
+            }
+        }
+    }
+    return returns;
+}
+
+mz_bool deflate_put(const void* buf, int len, void* user){
+    deflate_job* job = user;
+    if (job->data_size + len > job->capacity){
+        size_t capacity = job->capacity ? job->capacity * 2 : 65536;
+        while (capacity < job->data_size + len){
+            capacity *= 2;
+        }
+        void* tmp = realloc(job->data, capacity);
+        if (!tmp){
+            return MZ_FALSE;
+        }
+        job->data = tmp;
+        job->capacity = capacity;
+    }
+    memcpy((char*)(job->data) + job->data_size, buf, len);
+    job->data_size += len;
+    return MZ_TRUE;
+}
+
+void* deflate_worker(void* arg){
+    deflate_queue* queue = arg;
+    tdefl_compressor* comp = malloc(sizeof(tdefl_compressor));
+    while (true){
+        pthread_mutex_lock(&queue->lock);
+        while ((queue->next < queue->jobs_len) && (queue->next >= queue->written + queue->window)){
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        if (queue->next >= queue->jobs_len){
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        deflate_job* job = &queue->jobs[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+
+        bool ok = comp && (tdefl_init(comp, deflate_put, job, (int)queue->comp_flags) == TDEFL_STATUS_OKAY);
+        bool filtered = job->shuffle || job->refs[0];
+        char* scratch = NULL;
+        if (filtered && ok){
+            scratch = malloc(job->part_size * 2);
+            ok = scratch != NULL;
+        }
+        job->crc = MZ_CRC32_INIT;
+        for (int index = 0; (index < job->planes) && ok; index++){
+            const void* plane = job->parts[index];
+            size_t count = job->part_size / sizeof(float);
+            if (job->refs[0]){
+                xor_floats(scratch, plane, job->refs[index], count);
+                plane = scratch;
+            }
+            if (job->shuffle){
+                shuffle_bytes(scratch + job->part_size, plane, count);
+                plane = scratch + job->part_size;
+            }
+            job->crc = (mz_uint32)mz_crc32(job->crc, plane, job->part_size);
+            ok = tdefl_compress_buffer(comp, plane, job->part_size, TDEFL_NO_FLUSH) == TDEFL_STATUS_OKAY;
+        }
+        free(scratch);
+        ok = ok && (tdefl_compress_buffer(comp, NULL, 0, TDEFL_FINISH) == TDEFL_STATUS_DONE);
+
+        pthread_mutex_lock(&queue->lock);
+        job->ok = ok;
+        job->done = true;
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    free(comp);
+    return NULL;
+}
+
+//Loading inflates tensors on every core, each worker with its own reader of the archive, straight into the arena.
+typedef struct {
+    int file; //index in the archive
+    void* parts[3]; //where its value, m and v blocks go
+    int planes;
+    size_t part_size; //in bytes
+    bool shuffled;
+} inflate_job;
+
+typedef struct {
+    const char* path;
+    inflate_job* jobs;
+    int jobs_len;
+    int next; //first job no worker took yet
+    bool failed;
+    pthread_mutex_t lock;
+} inflate_queue;
+
+size_t write_planes(void* opaque, mz_uint64 offset, const void* buf, size_t n){
+    inflate_job* job = opaque;
+    size_t done = 0;
+    while ((done < n) && (offset < job->part_size * job->planes)){
+        size_t plane = offset / job->part_size;
+        size_t at = offset % job->part_size;
+        size_t run = job->part_size - at;
+        if (run > n - done){
+            run = n - done;
+        }
+        memcpy((char*)(job->parts[plane]) + at, (const char*)buf + done, run);
+        done += run;
+        offset += run;
+    }
+    return done;
+}
+
+void* inflate_worker(void* arg){
+    inflate_queue* queue = arg;
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    bool opened = mz_zip_reader_init_file(&zip, queue->path, 0);
+    char* scratch = NULL;
+    size_t scratch_size = 0;
+    while (true){
+        pthread_mutex_lock(&queue->lock);
+        if ((!opened) || queue->failed || (queue->next >= queue->jobs_len)){
+            queue->failed = queue->failed || (!opened);
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        inflate_job* job = &queue->jobs[queue->next++];
+        pthread_mutex_unlock(&queue->lock);
+
+        bool ok = mz_zip_reader_extract_to_callback(&zip, job->file, write_planes, job, 0);
+        if (ok && job->shuffled){
+            if (scratch_size < job->part_size){
+                free(scratch);
+                scratch = malloc(job->part_size);
+                scratch_size = scratch ? job->part_size : 0;
+            }
+            ok = scratch != NULL;
+            for (int index = 0; (index < job->planes) && ok; index++){
+                unshuffle_bytes(scratch, job->parts[index], job->part_size / sizeof(float));
+                memcpy(job->parts[index], scratch, job->part_size);
+            }
+        }
+        if (!ok){
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    free(scratch);
+    if (opened){
+        mz_zip_reader_end(&zip);
+    }
+    return NULL;
+}
+
+//Runs the jobs on up to one thread per core, false if any of them failed.
+bool inflate_all(const char* path, inflate_job* jobs, int jobs_len){
+    if (jobs_len == 0){
+        return true;
+    }
+    inflate_queue queue;
+    queue.path = path;
+    queue.jobs = jobs;
+    queue.jobs_len = jobs_len;
+    queue.next = 0;
+    queue.failed = false;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    int threads = cpu_count();
+    if (threads > jobs_len){
+        threads = jobs_len;
+    }
+    pthread_t* workers = malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+    int started = 0;
+    if (workers){
+        while ((started < threads) && (pthread_create(&workers[started], NULL, inflate_worker, &queue) == 0)){
+            started++;
+        }
+    }
+    if (started == 0){
+        inflate_worker(&queue);
+    }
+    for (int index = 0; index < started; index++){
+        pthread_join(workers[index], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&queue.lock);
+    return !queue.failed;
+}
+
+int main(int argc, char** argv){
+    int* ids = malloc(1); //1 byte init alloc
+
+    if (!ids){
+        printf("Failed memory allocation for ids, ids will not be tracked therefore ids may not be strictly unique.\n");
+    }
+
+    int ids_len = 0;
+
+    srand(time(NULL));
+
+    int genid(){
+        int id;
+        while (true){
+            id = rand() % 100000;
+
+            if (!ids){
+                return id;
+            }
+
+            if (ids_len == 100000){
+                printf("All possible ids combinations exhaused, this id will be a duplicate of another id.\n");
+                return id;
+            }
+
+            bool found = false;
+            for (int index = 0; index < ids_len; index++){
+                if (ids[index] == id){
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found){
+                break;
+            }
+        }
+        //grw
+        int* tmp_ids = realloc(ids, (ids_len + 1) * sizeof(int));
+        if (!tmp_ids){
+            printf("Failed memory allocation to grow ids list.\n");
+            return id; //better to return something than nothing
+        }
+        ids = tmp_ids;
+
+        ids[ids_len] = id;
+        ids_len++;
+        return id;
+    }
+
+    int freeId(int id){
+        int indexOfId = -1;
+        for (int index = 0; index < ids_len; index++){
+            if (id == ids[index]){
+                indexOfId = index;
+                break;
+            }
+        }
+        if (indexOfId == -1){
+            return -1; //id not found
+        }
+
+        //shrnk
+        int* n_ids = malloc((ids_len - 1) * sizeof(int));
+        if (!n_ids){
+            printf("Failed to allocate memory to shrink ids list.\n");
+            return -1;
+        }
+
+        int offset = 0;
+        for (int index = 0; index < ids_len; index++){
+            if (index == indexOfId){
+                offset += 1;
+                continue;
+            }
+            n_ids[index - offset] = ids[index];
+        }
+
+        free(ids);
+        ids = n_ids;
+        ids_len--;
+        return 0;
+    }
+
+    long long** timers = malloc(1); //1 byte init alloc
+    
+    if (!timers){
+        printf("Failed memory allocation for timers, timers will not be available.\n");
+    }
+
+    int timers_len = 0; //0 elements
+
+    long long timer(){
+        if (!timers){
+            return -1;
+        }
+
+        long long curr_time = time_ms();
+        
+        //grw
+        long long id = (long long)(genid());
+        
+        long long** tmp_timers = realloc(timers, (timers_len + 1) * sizeof(long long*));
+        if (!tmp_timers){
+            printf("Failed memory allocation to grow timers list.\n");
+            return -1;
+        }
+        timers = tmp_timers;
+        timers[timers_len] = malloc(2 * sizeof(long long)); //id, timestamp
 
         if (!timers[timers_len]){
             printf("Failed memory allocation to grow timers list.\n");
@@ -532,8 +2488,13 @@ int main(int argc, char** argv){
     bool do_train = false;
     bool new = false;
     bool load = false;
+    bool attach = false;
+    char* model_id = NULL;
+    int workers = 0;
+    int cli_checkpoint_level = -1; //--checkpoint-compression, wins over the config
+    char* export_location = NULL; //--export-inference
 
-    char* valid_flags[] = {"--new", "--load", "--config", "--train", "--pretrain", NULL};
+    char* valid_flags[] = {"--new", "--load", "--config", "--train", "--pretrain", "--attach", "--model-id", "--keep-shm", "--workers", "--checkpoint-compression", "--export-inference", NULL};
     int valid_flags_len = 0;
     while (true){
         if (!(valid_flags[valid_flags_len] == NULL)){
@@ -663,15 +2624,129 @@ int main(int argc, char** argv){
                             strcpy(config_location, nextArg);
                         }
                         else{
-                            int help_message_len = strlen("Arg \"") + strlen(arg) + strlen("\" is invalid.") + 1;
-                            char* help_message = malloc(help_message_len);
-                            if (!help_message){
-                                printf("Failed to allocate memory to parse args.\n");
-                                return 1;
+                            if ((strcmp(arg, "--attach") == 0) || (strcmp(arg, "--model-id") == 0)){
+                                if (model_id){
+                                    help("You can only specify one of --attach and --model-id, once.");
+                                    return 0;
+                                }
+                                if (argc - index - 1 == 0){
+                                    help("You need to specify a model id after --attach/--model-id.");
+                                    return 0;
+                                }
+                                nextIsVal = true;
+                                char* nextArg = argv[index + 1];
+                                for (int subindex = 0; subindex < valid_flags_len; subindex++){
+                                    if (strcmp(nextArg, valid_flags[subindex]) == 0){
+                                        nextIsVal = false;
+                                        break;
+                                    }
+                                }
+                                if (!nextIsVal){
+                                    help("You need to specify a model id after --attach/--model-id.");
+                                    return 0;
+                                }
+                                //It ends up in shared memory names, keep it to characters that are safe there.
+                                int id_len = strlen(nextArg);
+                                bool id_valid = id_len > 0 && id_len <= 64;
+                                for (int subindex = 0; subindex < id_len; subindex++){
+                                    char c = nextArg[subindex];
+                                    if (!(isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.')){
+                                        id_valid = false;
+                                    }
+                                }
+                                if (!id_valid){
+                                    help("Model ids are 1 to 64 letters, digits, '-', '_' or '.'.");
+                                    return 0;
+                                }
+                                model_id = nextArg;
+                                if (strcmp(arg, "--attach") == 0){
+                                    attach = true;
+                                }
+                            }
+                            else{
+                                if (strcmp(arg, "--keep-shm") == 0){
+                                    if (shm_keep){
+                                        help("You can't specify --keep-shm multiple times.");
+                                        return 0;
+                                    }
+                                    shm_keep = true;
+                                }
+                                else{
+                                    if (strcmp(arg, "--workers") == 0){
+                                        if (workers){
+                                            help("You can't specify --workers multiple times.");
+                                            return 0;
+                                        }
+                                        if (argc - index - 1 == 0){
+                                            help("You need to specify a worker count after --workers.");
+                                            return 0;
+                                        }
+                                        nextIsVal = true;
+                                        char* nextArg = argv[index + 1];
+                                        char* end;
+                                        long count = strtol(nextArg, &end, 10);
+                                        if ((end == nextArg) || (*end != '\0') || (count < 1) || (count > 1024)){
+                                            help("The worker count after --workers has to be a whole number from 1 to 1024.");
+                                            return 0;
+                                        }
+                                        workers = (int)count;
+                                    }
+                                    else{
+                                        if (strcmp(arg, "--checkpoint-compression") == 0){
+                                            if (cli_checkpoint_level != -1){
+                                                help("You can't specify --checkpoint-compression multiple times.");
+                                                return 0;
+                                            }
+                                            if (argc - index - 1 == 0){
+                                                help("You need to specify store, fast, default or best after --checkpoint-compression.");
+                                                return 0;
+                                            }
+                                            nextIsVal = true;
+                                            cli_checkpoint_level = compression_level(argv[index + 1]);
+                                            if (cli_checkpoint_level == -1){
+                                                help("You need to specify store, fast, default or best after --checkpoint-compression.");
+                                                return 0;
+                                            }
+                                        }
+                                        else{
+                                            if (strcmp(arg, "--export-inference") == 0){
+                                                if (export_location){
+                                                    help("You can't specify --export-inference multiple times.");
+                                                    return 0;
+                                                }
+                                                if (argc - index - 1 == 0){
+                                                    help("You need to specify a file path after --export-inference.");
+                                                    return 0;
+                                                }
+                                                nextIsVal = true;
+                                                char* nextArg = argv[index + 1];
+                                                for (int subindex = 0; subindex < valid_flags_len; subindex++){
+                                                    if (strcmp(nextArg, valid_flags[subindex]) == 0){
+                                                        nextIsVal = false;
+                                                        break;
+                                                    }
+                                                }
+                                                if (!nextIsVal){
+                                                    help("You need to specify a file path after --export-inference.");
+                                                    return 0;
+                                                }
+                                                export_location = nextArg;
+                                            }
+                                            else{
+                                                int help_message_len = strlen("Arg \"") + strlen(arg) + strlen("\" is invalid.") + 1;
+                                                char* help_message = malloc(help_message_len);
+                                                if (!help_message){
+                                                    printf("Failed to allocate memory to parse args.\n");
+                                                    return 1;
+                                                }
+                                                sprintf(help_message, "Arg \"%s\" is invalid.", arg);
+                                                help(help_message);
+                                                return 0;
+                                            }
+                                        }
+                                    }
+                                }
                             }
-                            sprintf(help_message, "Arg \"%s\" is invalid.", arg);
-                            help(help_message);
-                            return 0;
                         }
                     }
                 }
@@ -679,6 +2754,29 @@ int main(int argc, char** argv){
         }
     }
 
+    if (attach){
+        if (new || load){
+            help("You can't specify --attach with --new or --load.");
+            return 0;
+        }
+        if (shm_keep){
+            help("You can't specify --keep-shm with --attach, the model belongs to the process that created it.");
+            return 0;
+        }
+        if (do_train || do_pretrain){
+            help("You can't train an attached model, it is mapped read only.");
+            return 0;
+        }
+    }
+    else{
+        if (model_id || shm_keep || workers){
+            if ((!new) && (!load)){
+                help("--model-id, --keep-shm and --workers only make sense with --new or --load.");
+                return 0;
+            }
+        }
+    }
+
     if (new){
         if ((!do_pretrain) && (!do_train)){
             help("You need to specify either or both --pretrain and --train with --new.");
@@ -692,7 +2790,7 @@ int main(int argc, char** argv){
         }
     }
 
-    if (load){
+    if (load || attach){
         if (do_train || do_pretrain){
             if (!config_init){
                 help("You need to specify a config file path with --config.");
@@ -713,6 +2811,23 @@ int main(int argc, char** argv){
         }
     }
 
+    char pid_id[32];
+    if (!model_id){
+        snprintf(pid_id, sizeof pid_id, "%lu", getPid());
+        model_id = pid_id;
+    }
+
+    //Whatever we put in shared memory goes away with us, unless --keep-shm.
+    atexit(shm_cleanup);
+    signal(SIGINT, shm_cleanup_on_signal);
+    signal(SIGTERM, shm_cleanup_on_signal);
+#ifdef SIGHUP
+    signal(SIGHUP, shm_cleanup_on_signal);
+#endif
+    if ((!attach) && (!shm_claim(model_id))){
+        return 1;
+    }
+
     printf("Arguments parsed successfully :)\n");
 
     printf("Reading config file...\n");
@@ -1370,6 +3485,178 @@ int main(int argc, char** argv){
         }
     }
 
+    cJSON* hugepages_raw = cJSON_GetObjectItem(config, "hugepages");
+    if (!hugepages_raw){
+        printf("[Config] [Info] hugepages is missing, the model will use regular pages.\n");
+    }
+    else{
+        if (!cJSON_IsBool(hugepages_raw)){
+            printf("[Config] [Fatal] hugepages is supposed to be either true or false.\n");
+            return 1;
+        }
+        shm_hugepages = cJSON_IsTrue(hugepages_raw);
+    }
+
+    cJSON* prefault_raw = cJSON_GetObjectItem(config, "prefault");
+    if (!prefault_raw){
+        printf("[Config] [Info] prefault is missing, the model's memory will be faulted in on first touch.\n");
+    }
+    else{
+        if (!cJSON_IsBool(prefault_raw)){
+            printf("[Config] [Fatal] prefault is supposed to be either true or false.\n");
+            return 1;
+        }
+        shm_prefault = cJSON_IsTrue(prefault_raw);
+    }
+
+    bool native_checkpoints = false; //save the arena as is instead of zipping it, see save_native()
+    cJSON* checkpoint_format_raw = cJSON_GetObjectItem(config, "checkpoint-format");
+    if (!checkpoint_format_raw){
+        printf("[Config] [Info] checkpoint-format is missing, models will be saved as zip files.\n");
+    }
+    else{
+        if (!cJSON_IsString(checkpoint_format_raw)){
+            printf("[Config] [Fatal] checkpoint-format is supposed to be either \"zip\" or \"native\".\n");
+            return 1;
+        }
+        if (strcmp(checkpoint_format_raw->valuestring, "native") == 0){
+            native_checkpoints = true;
+        }
+        else{
+            if (strcmp(checkpoint_format_raw->valuestring, "zip") != 0){
+                printf("[Config] [Fatal] checkpoint-format is supposed to be either \"zip\" or \"native\" but it is set to %s.\n", checkpoint_format_raw->valuestring);
+                return 1;
+            }
+        }
+    }
+
+    int checkpoint_level = MZ_BEST_COMPRESSION;
+    cJSON* checkpoint_compression_raw = cJSON_GetObjectItem(config, "checkpoint-compression");
+    if (!checkpoint_compression_raw){
+        printf("[Config] [Info] checkpoint-compression is missing, zip checkpoints will use the best compression.\n");
+    }
+    else{
+        if (!cJSON_IsString(checkpoint_compression_raw)){
+            printf("[Config] [Fatal] checkpoint-compression is supposed to be either \"store\", \"fast\", \"default\" or \"best\".\n");
+            return 1;
+        }
+        checkpoint_level = compression_level(checkpoint_compression_raw->valuestring);
+        if (checkpoint_level == -1){
+            printf("[Config] [Fatal] checkpoint-compression is supposed to be either \"store\", \"fast\", \"default\" or \"best\" but it is set to %s.\n", checkpoint_compression_raw->valuestring);
+            return 1;
+        }
+    }
+    if (cli_checkpoint_level != -1){
+        checkpoint_level = cli_checkpoint_level;
+    }
+
+    bool checkpoint_shuffle = false;
+    cJSON* checkpoint_filter_raw = cJSON_GetObjectItem(config, "checkpoint-filter");
+    if (!checkpoint_filter_raw){
+        printf("[Config] [Info] checkpoint-filter is missing, tensors will be compressed as is.\n");
+    }
+    else{
+        if (!cJSON_IsString(checkpoint_filter_raw)){
+            printf("[Config] [Fatal] checkpoint-filter is supposed to be either \"none\" or \"shuffle\".\n");
+            return 1;
+        }
+        if (strcmp(checkpoint_filter_raw->valuestring, "shuffle") == 0){
+            checkpoint_shuffle = true;
+        }
+        else{
+            if (strcmp(checkpoint_filter_raw->valuestring, "none") != 0){
+                printf("[Config] [Fatal] checkpoint-filter is supposed to be either \"none\" or \"shuffle\" but it is set to %s.\n", checkpoint_filter_raw->valuestring);
+                return 1;
+            }
+        }
+    }
+
+    int checkpoint_xor = 0; //longest chain of checkpoints XORed against their predecessor before a full one is written
+    cJSON* checkpoint_xor_raw = cJSON_GetObjectItem(config, "checkpoint-xor");
+    if (!checkpoint_xor_raw){
+        printf("[Config] [Info] checkpoint-xor is missing, checkpoints won't be XORed against the previous one.\n");
+    }
+    else{
+        if ((!cJSON_IsNumber(checkpoint_xor_raw)) || (!isInt(checkpoint_xor_raw->valuedouble)) || (checkpoint_xor_raw->valuedouble < 0)){
+            printf("[Config] [Fatal] checkpoint-xor is supposed to be a whole number, 0 to disable.\n");
+            return 1;
+        }
+        checkpoint_xor = (int)(checkpoint_xor_raw->valuedouble);
+    }
+
+    int checkpoint_delta = 0; //longest chain of checkpoints holding only what changed since their predecessor before a full one is written
+    cJSON* checkpoint_delta_raw = cJSON_GetObjectItem(config, "checkpoint-delta");
+    if (!checkpoint_delta_raw){
+        printf("[Config] [Info] checkpoint-delta is missing, every checkpoint will hold the whole model.\n");
+    }
+    else{
+        if ((!cJSON_IsNumber(checkpoint_delta_raw)) || (!isInt(checkpoint_delta_raw->valuedouble)) || (checkpoint_delta_raw->valuedouble < 0)){
+            printf("[Config] [Fatal] checkpoint-delta is supposed to be a whole number, 0 to disable.\n");
+            return 1;
+        }
+        checkpoint_delta = (int)(checkpoint_delta_raw->valuedouble);
+    }
+    if ((checkpoint_delta > 0) && (checkpoint_xor > 0)){
+        printf("[Config] [Warning] checkpoint-xor is ignored when checkpoint-delta is set, unchanged tensors are left out instead.\n");
+        checkpoint_xor = 0;
+    }
+    bool keep_checkpoint_reference = (checkpoint_xor > 0) || (checkpoint_delta > 0);
+
+    bool async_checkpoints = false; //save from a forked child while training carries on, see save_snapshot()
+    cJSON* async_checkpoints_raw = cJSON_GetObjectItem(config, "async-checkpoints");
+    if (!async_checkpoints_raw){
+        printf("[Config] [Info] async-checkpoints is missing, training will wait for checkpoints to be written.\n");
+    }
+    else{
+        if (!cJSON_IsBool(async_checkpoints_raw)){
+            printf("[Config] [Fatal] async-checkpoints is supposed to be either true or false.\n");
+            return 1;
+        }
+        async_checkpoints = cJSON_IsTrue(async_checkpoints_raw);
+#ifdef _WIN32
+        if (async_checkpoints){
+            printf("[Config] [Warning] async-checkpoints needs fork, it isn't available on windows. Checkpoints will be written in the foreground.\n");
+            async_checkpoints = false;
+        }
+#endif
+    }
+
+    bool softmax_fast_exp = false; //cubic exp in softmax, about 1e-4 relative error instead of 1e-7
+    cJSON* softmax_exp_raw = cJSON_GetObjectItem(config, "softmax-exp");
+    if (!softmax_exp_raw){
+        printf("[Config] [Info] softmax-exp is missing, softmax will use the accurate exp.\n");
+    }
+    else{
+        if (!cJSON_IsString(softmax_exp_raw)){
+            printf("[Config] [Fatal] softmax-exp is supposed to be either \"accurate\" or \"fast\".\n");
+            return 1;
+        }
+        if (strcmp(softmax_exp_raw->valuestring, "fast") == 0){
+            softmax_fast_exp = true;
+        }
+        else{
+            if (strcmp(softmax_exp_raw->valuestring, "accurate") != 0){
+                printf("[Config] [Fatal] softmax-exp is supposed to be either \"accurate\" or \"fast\" but it is set to %s.\n", softmax_exp_raw->valuestring);
+                return 1;
+            }
+        }
+    }
+
+    cJSON* decode_threads_raw = cJSON_GetObjectItem(config, "decode-threads");
+    if (!decode_threads_raw){
+        printf("[Config] [Info] decode-threads is missing, single token projections will run on one thread.\n");
+    }
+    else{
+        if ((!cJSON_IsNumber(decode_threads_raw)) || (!isInt(decode_threads_raw->valuedouble)) || (decode_threads_raw->valuedouble < 0)){
+            printf("[Config] [Fatal] decode-threads is supposed to be a whole number, 0 for one per cpu.\n");
+            return 1;
+        }
+        gemv_threads = (int)(decode_threads_raw->valuedouble);
+        if (gemv_threads == 0){
+            gemv_threads = cpu_count();
+        }
+    }
+
     float* he_init(float fan_in){
         float* returns = malloc(2 * sizeof(float));
         if (!returns){
@@ -1561,7 +3848,7 @@ int main(int argc, char** argv){
     }
 
     char* id_to_token(int id){
-        if (id > gap_size + vocab_len){
+        if (id >= gap_size + vocab_len){
             return NULL;
         }
         else{
@@ -1666,10 +3953,14 @@ int main(int argc, char** argv){
         return min + ((float)rand() / (float)RAND_MAX) * (max - min);
     }
 
+    //Attention weights of a layer are packed in one qkv tensor, all query heads then all key heads then all value heads,
+    //each head being an [embeddingSize x embeddingSize] block with one row per output. heads[] are views into it,
+    //so one [3 * heads * embeddingSize x embeddingSize] GEMM projects every head at once.
     typedef struct {
         struct {
             float* normalize_1;
             struct {
+                float* qkv;
                 struct {
                     float* query;
                     float* key;
@@ -1686,6 +3977,7 @@ int main(int argc, char** argv){
         struct {
             float* normalize_1;
             struct {
+                float* qkv;
                 struct {
                     float* query;
                     float* key;
@@ -1711,8 +4003,7 @@ int main(int argc, char** argv){
     char* mname(const char* fmt, ...) {
         if (!fmt) return NULL;
 
-        char pidbuf[32];
-        snprintf(pidbuf, sizeof pidbuf, "%lu", getPid());
+        //Names are "/<model id>_<what>", stable for a given id so other processes can find them.
 
         va_list ap;
         va_start(ap, fmt);
@@ -1730,7 +4021,7 @@ int main(int argc, char** argv){
 #endif
         if (needed < 0) { va_end(ap); return NULL; }
 
-        size_t prefix_len = strlen(pidbuf) + 2; // '/' and '_'
+        size_t prefix_len = strlen(model_id) + 2; // '/' and '_'
         size_t total = prefix_len + (size_t)needed + 1;
 
         char* out = malloc(total);
@@ -1740,243 +4031,567 @@ int main(int argc, char** argv){
             return NULL;
         }
 
-        int wrote = snprintf(out, total, "/%s_", pidbuf);
-        (void)vsnprintf(out + wrote, total - (size_t)wrote, fmt, ap);
-        va_end(ap);
-        return out;
+        int wrote = snprintf(out, total, "/%s_", model_id);
+        (void)vsnprintf(out + wrote, total - (size_t)wrote, fmt, ap);
+        va_end(ap);
+        return out;
+    }
+
+    //Chat we cookin
+    layer* layers = NULL;
+    float* embeddings = NULL; //dense [(vocab_len + gap_size) x embeddingSize] table, gap rows stay zeroed
+
+    //Every tensor of the model lives in one shared memory arena instead of one segment per tensor,
+    //tensor_table remembers where each of them sits inside of it.
+    typedef struct {
+        char* name;
+        size_t offset; //in bytes from the start of the arena
+        size_t size; //in bytes
+    } tensor_entry;
+
+    #define TENSOR_ALIGN 64 //every tensor (and plane) starts on a cache line, so wide loads never split one
+
+    tensor_entry* tensor_table = NULL;
+    int tensor_table_len = 0;
+    int tensor_table_cap = 0;
+    size_t plane_size = 0; //bytes of one plane, the arena holds the values, adam m and adam v planes back to back
+    size_t arena_size = 0;
+    int model_planes = 3; //1 for inference only models, which have no adam moments
+    char* arena = NULL;
+    char* file_map = NULL; //set when the arena lives in a mapped native checkpoint rather than shared memory
+    size_t file_map_size = 0;
+    bool arena_on_hugetlbfs = false; //where the arena's segment is, see shm_on_hugetlbfs()
+
+    //Copy of the arena as of the last checkpoint saved or loaded, what the next one gets XORed against (checkpoint-xor)
+    //or compared with to leave out unchanged tensors (checkpoint-delta).
+    char* xor_reference = NULL;
+    char* xor_reference_path = NULL;
+    int xor_reference_depth = 0; //how many checkpoints depending on their predecessor lead up to it
+    char** reference_ancestors = NULL; //every checkpoint xor_reference_path needs to load, base first
+    int reference_ancestors_len = 0;
+    bool in_snapshot_child = false; //set in the child writing a background checkpoint, see save_snapshot()
+
+    void add_reference_ancestor(char* path){
+        char** tmp = realloc(reference_ancestors, (reference_ancestors_len + 1) * sizeof(char*));
+        char* path_copy = malloc(strlen(path) + 1);
+        if ((!tmp) || (!path_copy)){
+            //Not knowing an ancestor would let a checkpoint overwrite it, better no reference at all.
+            printf("Failed to allocate memory to keep a checkpoint reference, the next checkpoint will be a full one.\n");
+            if (tmp){
+                reference_ancestors = tmp;
+            }
+            free(path_copy);
+            free(xor_reference);
+            xor_reference = NULL;
+            return;
+        }
+        reference_ancestors = tmp;
+        strcpy(path_copy, path);
+        reference_ancestors[reference_ancestors_len++] = path_copy;
+    }
+
+    //Takes a copy of source (an arena sized buffer) as the reference for the next checkpoint. extends is set
+    //when the checkpoint at path depends on the current reference, which then becomes one of its ancestors.
+    void set_xor_reference(char* path, int depth, const char* source, bool extends){
+        if (extends && xor_reference_path){
+            add_reference_ancestor(xor_reference_path);
+        }
+        else{
+            for (int index = 0; index < reference_ancestors_len; index++){
+                free(reference_ancestors[index]);
+            }
+            reference_ancestors_len = 0;
+        }
+        if (!xor_reference){
+            xor_reference = malloc(arena_size);
+            if (!xor_reference){
+                printf("Failed to allocate memory to keep a checkpoint reference, the next checkpoint will be a full one.\n");
+                return;
+            }
+        }
+        char* path_copy = malloc(strlen(path) + 1);
+        if (!path_copy){
+            printf("Failed to allocate memory to keep a checkpoint reference, the next checkpoint will be a full one.\n");
+            free(xor_reference);
+            xor_reference = NULL;
+            return;
+        }
+        strcpy(path_copy, path);
+        free(xor_reference_path);
+        xor_reference_path = path_copy;
+        memcpy(xor_reference, source, arena_size);
+        xor_reference_depth = depth;
+    }
+
+    //Whether path is the reference or anything it depends on. Writing a checkpoint that depends on the reference
+    //over one of those would leave a chain that loops back on itself with the original data gone.
+    bool in_reference_chain(char* path){
+        if (same_file(xor_reference_path, path)){
+            return true;
+        }
+        for (int index = 0; index < reference_ancestors_len; index++){
+            if (same_file(reference_ancestors[index], path)){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    char* layout_base = NULL;
+    int layout_cursor = 0;
+
+    //Without a base this appends the tensor to the table, with one it points dst at its spot in the values plane.
+    //count is in floats, the tensor's adam moments sit at the same offset in the m and v planes.
+    void layout_tensor(float** dst, size_t count, const char* fmt, ...){
+        if (layout_base){
+            *dst = (float*)(layout_base + tensor_table[layout_cursor].offset);
+            layout_cursor++;
+            return;
+        }
+        if (tensor_table_len == tensor_table_cap){
+            int new_cap = tensor_table_cap == 0 ? 64 : tensor_table_cap * 2;
+            tensor_entry* tmp_table = realloc(tensor_table, new_cap * sizeof(tensor_entry));
+            if (!tmp_table){
+                printf("Failed to allocate memory to lay out the model.\n");
+                exit(1);
+            }
+            tensor_table = tmp_table;
+            tensor_table_cap = new_cap;
+        }
+
+        va_list ap;
+        va_start(ap, fmt);
+        va_list ap1; va_copy(ap1, ap);
+        int needed = vsnprintf(NULL, 0, fmt, ap1);
+        va_end(ap1);
+        char* name = malloc(needed + 1);
+        if (!name){
+            printf("Failed to allocate memory to lay out the model.\n");
+            exit(1);
+        }
+        vsnprintf(name, needed + 1, fmt, ap);
+        va_end(ap);
+
+        plane_size = (plane_size + TENSOR_ALIGN - 1) / TENSOR_ALIGN * TENSOR_ALIGN;
+        tensor_table[tensor_table_len].name = name;
+        tensor_table[tensor_table_len].offset = plane_size;
+        tensor_table[tensor_table_len].size = count * sizeof(float);
+        plane_size += tensor_table[tensor_table_len].size;
+        tensor_table_len++;
+        *dst = NULL;
+    }
+
+    //Walks the whole model in a fixed order, first call (base == NULL) builds tensor_table,
+    //second call (base == arena) hands out the pointers.
+    void layout_model(char* base){
+        layout_base = base;
+        layout_cursor = 0;
+        for (int index = 0; index < layersAmount; index++){
+            layout_tensor(&layers[index].weights.normalize_1, embeddingSize, "layers[%d].weights.normalize_1", index);
+            layout_tensor(&layers[index].weights.normalize_2, embeddingSize, "layers[%d].weights.normalize_2", index);
+            layout_tensor(&layers[index].biases.normalize_1, embeddingSize, "layers[%d].biases.normalize_1", index);
+            layout_tensor(&layers[index].biases.normalize_2, embeddingSize, "layers[%d].biases.normalize_2", index);
+            layout_tensor(&layers[index].weights.attention.qkv, (size_t)(3) * heads * embeddingSize * embeddingSize, "layers[%d].weights.attention.qkv", index);
+            layout_tensor(&layers[index].biases.attention.qkv, (size_t)(3) * heads * embeddingSize, "layers[%d].biases.attention.qkv", index);
+            for (int subindex = 0; subindex < heads; subindex++){
+                float* w_qkv = layers[index].weights.attention.qkv;
+                float* b_qkv = layers[index].biases.attention.qkv;
+                size_t w_block = (size_t)(embeddingSize) * embeddingSize;
+                size_t b_block = (size_t)(embeddingSize);
+                layers[index].weights.attention.heads[subindex].query = w_qkv ? w_qkv + (0 * heads + subindex) * w_block : NULL;
+                layers[index].weights.attention.heads[subindex].key = w_qkv ? w_qkv + (1 * heads + subindex) * w_block : NULL;
+                layers[index].weights.attention.heads[subindex].value = w_qkv ? w_qkv + (2 * heads + subindex) * w_block : NULL;
+                layers[index].biases.attention.heads[subindex].query = b_qkv ? b_qkv + (0 * heads + subindex) * b_block : NULL;
+                layers[index].biases.attention.heads[subindex].key = b_qkv ? b_qkv + (1 * heads + subindex) * b_block : NULL;
+                layers[index].biases.attention.heads[subindex].value = b_qkv ? b_qkv + (2 * heads + subindex) * b_block : NULL;
+            }
+            layout_tensor(&layers[index].weights.attention.output, (size_t)(embeddingSize) * embeddingSize * heads, "layers[%d].weights.attention.output", index);
+            layout_tensor(&layers[index].biases.attention.output, embeddingSize, "layers[%d].biases.attention.output", index);
+            layout_tensor(&layers[index].weights.feed_forward.grow, (size_t)(embeddingSize) * embeddingSize * 4, "layers[%d].weights.feed_forward.grow", index);
+            layout_tensor(&layers[index].weights.feed_forward.shrink, (size_t)(embeddingSize) * embeddingSize * 4, "layers[%d].weights.feed_forward.shrink", index);
+            layout_tensor(&layers[index].biases.feed_forward.grow, (size_t)(embeddingSize) * 4, "layers[%d].biases.feed_forward.grow", index);
+            layout_tensor(&layers[index].biases.feed_forward.shrink, embeddingSize, "layers[%d].biases.feed_forward.shrink", index);
+        }
+        layout_tensor(&embeddings, (size_t)(vocab_len + gap_size) * embeddingSize, "embeddings");
+        layout_tensor(&vocab_projection.weights, (size_t)(vocab_len) * embeddingSize, "vocab_projection.weights");
+        layout_tensor(&vocab_projection.biases, vocab_len, "vocab_projection.biases");
+    }
+
+    //FNV-1a over tensor_table, two builds lay a model out the same way if this matches.
+    uint32_t layout_hash(){
+        uint32_t hash = 2166136261u;
+        void mix(const void* data, size_t len){
+            for (size_t index = 0; index < len; index++){
+                hash = (hash ^ ((const unsigned char*)data)[index]) * 16777619u;
+            }
+        }
+        for (int index = 0; index < tensor_table_len; index++){
+            uint64_t offset = tensor_table[index].offset;
+            uint64_t size = tensor_table[index].size;
+            mix(tensor_table[index].name, strlen(tensor_table[index].name) + 1);
+            mix(&offset, sizeof offset);
+            mix(&size, sizeof size);
+        }
+        return hash;
+    }
+
+    //Needs embeddingSize, layersAmount and heads to be known. Allocates the layer structs and builds tensor_table.
+    bool plan_model(){
+        layers = malloc(layersAmount * sizeof(layer));
+        if (!layers){
+            printf("Failed to allocate memory to allocate the model.\n");
+            return false;
+        }
+        for (int index = 0; index < layersAmount; index++){
+            layers[index].weights.attention.heads = malloc(heads * sizeof(*layers[index].weights.attention.heads));
+            layers[index].biases.attention.heads = malloc(heads * sizeof(*layers[index].biases.attention.heads));
+            if (!layers[index].weights.attention.heads){
+                printf("Failed to allocate memory to allocate the model.\n");
+                return false;
+            }
+            if (!layers[index].biases.attention.heads){
+                printf("Failed to allocate memory to allocate the model.\n");
+                return false;
+            }
+        }
+        layout_model(NULL);
+        plane_size = (plane_size + TENSOR_ALIGN - 1) / TENSOR_ALIGN * TENSOR_ALIGN;
+        arena_size = plane_size * model_planes;
+        return true;
+    }
+
+    bool create_model_arena(){
+        if (!plan_model()){
+            return false;
+        }
+
+        char* name = mname("model");
+        if (!name){
+            return false;
+        }
+        arena = smalloc(arena_size, name, shm_hugepages);
+        arena_on_hugetlbfs = shm_on_hugetlbfs(name);
+        free(name);
+        if (!arena){
+            if (errno == EEXIST){
+                printf("Model \"%s\" was kept in shared memory (--keep-shm) by an earlier run, --attach to it, pick another --model-id or delete its segments from /dev/shm.\n", model_id);
+            }
+            else{
+                printf("Failed to allocate memory to allocate the model.\n");
+            }
+            return false;
+        }
+
+        layout_model(arena);
+        printf("Allocated %d tensors in one %zu bytes shared memory arena.\n", tensor_table_len, arena_size);
+        return true;
+    }
+
+    //The manifest is a second segment ("/<model id>_manifest") describing the arena, it is what --attach reads.
+    #define MANIFEST_MAGIC "CAIMDL1"
+
+    typedef struct {
+        char magic[8];
+        int32_t embeddingSize;
+        int32_t layersAmount;
+        int32_t heads;
+        int32_t vocab_rows; //vocab_len + gap_size
+        int32_t tensors;
+        int32_t step_num;
+        float biasesinitrange[2];
+        float embeddinginitrange[2];
+        float beta1;
+        float beta2;
+        float epsilon;
+        int32_t t;
+        int32_t planes; //3, or 1 for inference only models
+        int32_t hugetlbfs; //1 if the arena segment is on hugetlbfs rather than in /dev/shm, 0 in native checkpoints
+        uint64_t plane_size;
+        uint64_t arena_size;
+    } manifest_header;
+
+    typedef struct {
+        char name[96];
+        char dtype[8];
+        uint64_t offset; //in bytes from the start of the values plane
+        uint64_t size; //in bytes, per plane
+    } manifest_entry;
+
+    //Describes the current model and tensor_table, manifest has to have room for the entries. planes is 1 to describe the values only.
+    void fill_manifest(manifest_header* manifest, const char* magic, int planes){
+        memcpy(manifest->magic, magic, 8);
+        manifest->embeddingSize = embeddingSize;
+        manifest->layersAmount = layersAmount;
+        manifest->heads = heads;
+        manifest->vocab_rows = vocab_len + gap_size;
+        manifest->tensors = tensor_table_len;
+        manifest->step_num = step_num;
+        manifest->biasesinitrange[0] = biasesinitrange[0];
+        manifest->biasesinitrange[1] = biasesinitrange[1];
+        manifest->embeddinginitrange[0] = embeddinginitrange[0];
+        manifest->embeddinginitrange[1] = embeddinginitrange[1];
+        manifest->beta1 = adam_params.beta1;
+        manifest->beta2 = adam_params.beta2;
+        manifest->epsilon = adam_params.epsilon;
+        manifest->t = adam_params.t;
+        manifest->planes = planes;
+        manifest->hugetlbfs = arena_on_hugetlbfs && (strcmp(magic, MANIFEST_MAGIC) == 0);
+        manifest->plane_size = plane_size;
+        manifest->arena_size = plane_size * planes;
+
+        manifest_entry* entries = (manifest_entry*)(manifest + 1);
+        for (int index = 0; index < tensor_table_len; index++){
+            memset(&entries[index], 0, sizeof(manifest_entry));
+            snprintf(entries[index].name, sizeof entries[index].name, "%s", tensor_table[index].name);
+            snprintf(entries[index].dtype, sizeof entries[index].dtype, "f32");
+            entries[index].offset = tensor_table[index].offset;
+            entries[index].size = tensor_table[index].size;
+        }
+    }
+
+    //Takes the hyperparameters from a manifest and plans the layout, failing if it doesn't come out tensor for tensor the same.
+    bool adopt_manifest(manifest_header* manifest){
+        if (manifest->vocab_rows != vocab_len + gap_size){
+            printf("The model doesn't use the same vocabulary as yours.\n");
+            return false;
+        }
+        //planes went into what used to be padding, files written before it have 0 there and always held all three.
+        int planes = (manifest->planes == 0) ? 3 : manifest->planes;
+        if ((manifest->embeddingSize < 1) || (manifest->layersAmount < 1) || (manifest->heads < 1) || ((planes != 1) && (planes != 3))){
+            printf("Model file is corrupted.\n");
+            return false;
+        }
+
+        embeddingSize = manifest->embeddingSize;
+        layersAmount = manifest->layersAmount;
+        heads = manifest->heads;
+        step_num = manifest->step_num;
+        if (!biasesinitrange){
+            biasesinitrange = malloc(2 * sizeof(float));
+        }
+        if (!embeddinginitrange){
+            embeddinginitrange = malloc(2 * sizeof(float));
+        }
+        if (!biasesinitrange || !embeddinginitrange){
+            printf("Failed to allocate memory to load model.\n");
+            return false;
+        }
+        biasesinitrange[0] = manifest->biasesinitrange[0];
+        biasesinitrange[1] = manifest->biasesinitrange[1];
+        embeddinginitrange[0] = manifest->embeddinginitrange[0];
+        embeddinginitrange[1] = manifest->embeddinginitrange[1];
+        adam_params.beta1 = manifest->beta1;
+        adam_params.beta2 = manifest->beta2;
+        adam_params.epsilon = manifest->epsilon;
+        adam_params.t = manifest->t;
+        model_planes = planes;
+
+        if (!plan_model()){
+            return false;
+        }
+        //Our layout has to match the writer's tensor for tensor, otherwise we'd read the wrong bytes.
+        if (manifest->tensors != tensor_table_len || manifest->plane_size != plane_size || manifest->arena_size != arena_size){
+            printf("The model was laid out by an incompatible version.\n");
+            return false;
+        }
+        manifest_entry* entries = (manifest_entry*)(manifest + 1);
+        for (int index = 0; index < tensor_table_len; index++){
+            if (strncmp(entries[index].name, tensor_table[index].name, sizeof entries[index].name - 1) != 0 || entries[index].offset != tensor_table[index].offset || entries[index].size != tensor_table[index].size){
+                printf("The model was laid out by an incompatible version.\n");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //Call once the model is fully initialized or loaded, attaching before that would read garbage.
+    bool publish_manifest(){
+        size_t size = sizeof(manifest_header) + tensor_table_len * sizeof(manifest_entry);
+        char* name = mname("manifest");
+        if (!name){
+            return false;
+        }
+        manifest_header* manifest = smalloc(size, name, false);
+        free(name);
+        if (!manifest){
+            if (errno == EEXIST){
+                printf("Model \"%s\" was kept in shared memory (--keep-shm) by an earlier run, --attach to it, pick another --model-id or delete its segments from /dev/shm.\n", model_id);
+            }
+            else{
+                printf("Failed to allocate memory to publish the model's manifest.\n");
+            }
+            return false;
+        }
+        fill_manifest(manifest, MANIFEST_MAGIC, model_planes);
+        printf("Published model as \"%s\" in shared memory.\n", model_id);
+        return true;
+    }
+
+    //Points every tensor at a read only mapping of the published model, needs the layout to be planned already.
+    bool map_model_readonly(){
+        char* name = mname("model");
+        if (!name){
+            return false;
+        }
+        arena = rmalloc(name, false, arena_on_hugetlbfs);
+        free(name);
+        if (!arena){
+            printf("Failed to map model \"%s\" from shared memory.\n", model_id);
+            return false;
+        }
+        layout_model(arena);
+        return true;
+    }
+
+    //Maps a model another process published under model_id instead of loading it from disk, read only.
+    bool attach_model(){
+        char* name = mname("manifest");
+        if (!name){
+            return false;
+        }
+        manifest_header* manifest = rmalloc(name, false, false);
+        free(name);
+        if (!manifest){
+            printf("There is no model with id \"%s\" in shared memory.\n", model_id);
+            return false;
+        }
+        if (memcmp(manifest->magic, MANIFEST_MAGIC, 8) != 0){
+            printf("Shared memory manifest of model \"%s\" is corrupted.\n", model_id);
+            return false;
+        }
+        if (!adopt_manifest(manifest)){
+            return false;
+        }
+        arena_on_hugetlbfs = manifest->hugetlbfs != 0;
+        return map_model_readonly();
+    }
+
+    //Native checkpoints are a manifest (with NATIVE_MAGIC) followed by the arena's bytes at the next NATIVE_ALIGN boundary, so loading one is just mapping it.
+    #define NATIVE_MAGIC "CAINAT1"
+    #define NATIVE_ALIGN 4096
+
+    size_t native_data_offset(int tensors){
+        size_t offset = sizeof(manifest_header) + (size_t)tensors * sizeof(manifest_entry);
+        return (offset + NATIVE_ALIGN - 1) / NATIVE_ALIGN * NATIVE_ALIGN;
+    }
+
+    bool is_native_checkpoint(char* path){
+        FILE* file = fopen(path, "rb");
+        if (!file){
+            return false;
+        }
+        char magic[8];
+        bool native = (fread(magic, 1, 8, file) == 8) && (memcmp(magic, NATIVE_MAGIC, 8) == 0);
+        fclose(file);
+        return native;
+    }
+
+    //Writable maps the file copy on write so training never touches the checkpoint, otherwise every process shares the page cache read only.
+    bool load_native_checkpoint(char* path, bool writable){
+        size_t size;
+        char* map = map_file(path, writable, &size);
+        if (!map){
+            printf("Failed to open model file (\"%s\").\n", path);
+            return false;
+        }
+        manifest_header* manifest = (manifest_header*)map;
+        if ((size < sizeof(manifest_header)) || (memcmp(manifest->magic, NATIVE_MAGIC, 8) != 0) || (manifest->tensors < 0) || (size < native_data_offset(manifest->tensors))){
+            printf("Model file is corrupted.\n");
+            unmap_file(map, size);
+            return false;
+        }
+        if (!adopt_manifest(manifest)){
+            unmap_file(map, size);
+            return false;
+        }
+        size_t data_offset = native_data_offset(manifest->tensors);
+        if (size - data_offset < arena_size){
+            printf("Model file is corrupted.\n");
+            unmap_file(map, size);
+            return false;
+        }
+        file_map = map;
+        file_map_size = size;
+        arena = map + data_offset;
+        layout_model(arena);
+        return true;
+    }
+
+    //Adam moments of a parameter, only the optimizer should need these.
+    float* adam_m(float* param){
+        if (model_planes == 1){
+            printf("Adam moments aren't allocated for inference only models.\n");
+            exit(1);
+        }
+        return (float*)((char*)(param) + plane_size);
+    }
+
+    float* adam_v(float* param){
+        if (model_planes == 1){
+            printf("Adam moments aren't allocated for inference only models.\n");
+            exit(1);
+        }
+        return (float*)((char*)(param) + plane_size * 2);
     }
 
-    //Chat we cookin
-    layer* layers = NULL;
-    float** embeddings = NULL;
+    //Row of an id in the embedding table, no checks, that's get_embedding's job.
+    float* embedding_row(int id){
+        return embeddings + (size_t)(id) * embeddingSize;
+    }
+
+    bool native_load = load && is_native_checkpoint(model_location);
+
     if (new){
-        layers = malloc(layersAmount * sizeof(layer));
-        if (!layers){
-            printf("Failed to allocate memory to initalize layers.\n");
+        if (!create_model_arena()){
             return 1;
         }
         for (int index = 0; index < layersAmount; index++){
             printf("Initalizing layer %d/%d...\n", index + 1, layersAmount);
             long long timer__ = timer();
-            char* name = mname("layers[%d].weights.normalize_1", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].weights.normalize_1 = smalloc(embeddingSize * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].weights.normalize_2", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].weights.normalize_2 = smalloc(embeddingSize * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].biases.normalize_1", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].biases.normalize_1 = smalloc(embeddingSize * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].biases.normalize_2", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].biases.normalize_2 = smalloc(embeddingSize * 3 * sizeof(float), name);
-            layers[index].weights.attention.heads = malloc(heads * sizeof(*layers[index].weights.attention.heads));
-            layers[index].biases.attention.heads = malloc(heads * sizeof(*layers[index].biases.attention.heads));
-            free(name);
-            name = mname("layers[%d].weights.attention.output", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].weights.attention.output = smalloc(embeddingSize * (embeddingSize * heads) * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].biases.attention.output", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].biases.attention.output = smalloc(embeddingSize * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].weights.feed_forward.grow", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].weights.feed_forward.grow = smalloc(embeddingSize * (embeddingSize * 4) * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].weights.feed_forward.shrink", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].weights.feed_forward.shrink = smalloc(embeddingSize * (embeddingSize * 4) * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].biases.feed_forward.grow", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].biases.feed_forward.grow = smalloc((embeddingSize * 4) * 3 * sizeof(float), name);
-            free(name);
-            name = mname("layers[%d].biases.feed_forward.shrink", index);
-            if (!name){
-                return 1;
-            }
-            layers[index].biases.feed_forward.shrink = smalloc(embeddingSize * 3 * sizeof(float), name);
-            free(name);
-
-            if (!layers[index].weights.normalize_1){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].weights.normalize_2){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].biases.normalize_1){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].biases.normalize_2){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].weights.attention.heads){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].biases.attention.heads){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].weights.attention.output){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].biases.attention.output){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].weights.feed_forward.grow){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].weights.feed_forward.shrink){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].biases.feed_forward.grow){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
-            if (!layers[index].biases.feed_forward.shrink){
-                printf("Failed to allocate memory to initalize layers.\n");
-                return 1;
-            }
 
             for (int subindex = 0; subindex < embeddingSize; subindex++){
-                layers[index].weights.normalize_1[subindex * 3] = random_range(weightsinitrange);
-                layers[index].weights.normalize_2[subindex * 3] = random_range(weightsinitrange);
-                layers[index].biases.normalize_1[subindex * 3] = random_range(biasesinitrange);
-                layers[index].biases.normalize_2[subindex * 3] = random_range(biasesinitrange);
+                layers[index].weights.normalize_1[subindex] = random_range(weightsinitrange);
+                layers[index].weights.normalize_2[subindex] = random_range(weightsinitrange);
+                layers[index].biases.normalize_1[subindex] = random_range(biasesinitrange);
+                layers[index].biases.normalize_2[subindex] = random_range(biasesinitrange);
             }
 
             for (int subindex = 0; subindex < heads; subindex++){
-                name = mname("layers[%d].weights.attention.heads[%d].query", index, subindex);
-                if (!name){
-                    return 1;
-                }
-                layers[index].weights.attention.heads[subindex].query = smalloc(embeddingSize * embeddingSize * 3 * sizeof(float), name);
-                free(name);
-                name = mname("layers[%d].weights.attention.heads[%d].key", index, subindex);
-                if (!name){
-                    return 1;
-                }
-                layers[index].weights.attention.heads[subindex].key = smalloc(embeddingSize * embeddingSize * 3 * sizeof(float), name);
-                free(name);
-                name = mname("layers[%d].weights.attention.heads[%d].value", index, subindex);
-                if (!name){
-                    return 1;
-                }
-                layers[index].weights.attention.heads[subindex].value = smalloc(embeddingSize * embeddingSize * 3 * sizeof(float), name);
-                
-                free(name);
-                name = mname("layers[%d].biases.attention.heads[%d].query", index, subindex);
-                if (!name){
-                    return 1;
-                }
-                layers[index].biases.attention.heads[subindex].query = smalloc(embeddingSize * 3 * sizeof(float), name);
-                free(name);
-                name = mname("layers[%d].biases.attention.heads[%d].key", index, subindex);
-                if (!name){
-                    return 1;
-                }
-                layers[index].biases.attention.heads[subindex].key = smalloc(embeddingSize * 3 * sizeof(float), name);
-                free(name);
-                name = mname("layers[%d].biases.attention.heads[%d].value", index, subindex);
-                if (!name){
-                    return 1;
-                }
-                layers[index].biases.attention.heads[subindex].value = smalloc(embeddingSize * 3 * sizeof(float), name);
-                free(name);
-
-                if (!layers[index].weights.attention.heads[subindex].query){
-                    printf("Failed to allocate memory to initalize layers.\n");
-                    return 1;
-                }
-                if (!layers[index].weights.attention.heads[subindex].key){
-                    printf("Failed to allocate memory to initalize layers.\n");
-                    return 1;
-                }
-                if (!layers[index].weights.attention.heads[subindex].value){
-                    printf("Failed to allocate memory to initalize layers.\n");
-                    return 1;
-                }
-
-                if (!layers[index].biases.attention.heads[subindex].query){
-                    printf("Failed to allocate memory to initalize layers.\n");
-                    return 1;
-                }
-                if (!layers[index].biases.attention.heads[subindex].key){
-                    printf("Failed to allocate memory to initalize layers.\n");
-                    return 1;
-                }
-                if (!layers[index].biases.attention.heads[subindex].value){
-                    printf("Failed to allocate memory to initalize layers.\n");
-                    return 1;
-                }
-
                 for (int subindex_ = 0; subindex_ < embeddingSize * embeddingSize; subindex_++){
-                    layers[index].weights.attention.heads[subindex].query[subindex_ * 3] = random_range(weightsinitrange);
-                    layers[index].weights.attention.heads[subindex].key[subindex_ * 3] = random_range(weightsinitrange);
-                    layers[index].weights.attention.heads[subindex].value[subindex_ * 3] = random_range(weightsinitrange);
+                    layers[index].weights.attention.heads[subindex].query[subindex_] = random_range(weightsinitrange);
+                    layers[index].weights.attention.heads[subindex].key[subindex_] = random_range(weightsinitrange);
+                    layers[index].weights.attention.heads[subindex].value[subindex_] = random_range(weightsinitrange);
                 }
 
                 for (int subindex_ = 0; subindex_ < embeddingSize; subindex_++){
-                    layers[index].biases.attention.heads[subindex].query[subindex_ * 3] = random_range(biasesinitrange);
-                    layers[index].biases.attention.heads[subindex].key[subindex_ * 3] = random_range(biasesinitrange);
-                    layers[index].biases.attention.heads[subindex].value[subindex_ * 3] = random_range(biasesinitrange);
+                    layers[index].biases.attention.heads[subindex].query[subindex_] = random_range(biasesinitrange);
+                    layers[index].biases.attention.heads[subindex].key[subindex_] = random_range(biasesinitrange);
+                    layers[index].biases.attention.heads[subindex].value[subindex_] = random_range(biasesinitrange);
                 }
             }
 
             for (int subindex = 0; subindex < embeddingSize * (embeddingSize * heads); subindex++){
-                layers[index].weights.attention.output[subindex * 3] = random_range(weightsinitrange);
+                layers[index].weights.attention.output[subindex] = random_range(weightsinitrange);
             }
 
             for (int subindex = 0; subindex < embeddingSize; subindex++){
-                layers[index].biases.attention.output[subindex * 3] = random_range(biasesinitrange);
+                layers[index].biases.attention.output[subindex] = random_range(biasesinitrange);
             }
 
             for (int subindex = 0; subindex < embeddingSize * (embeddingSize * 4); subindex++){
-                layers[index].weights.feed_forward.grow[subindex * 3] = random_range(weightsinitrange);
+                layers[index].weights.feed_forward.grow[subindex] = random_range(weightsinitrange);
             }
 
             for (int subindex = 0; subindex < embeddingSize * 4; subindex++){
-                layers[index].biases.feed_forward.grow[subindex * 3] = random_range(biasesinitrange);
+                layers[index].biases.feed_forward.grow[subindex] = random_range(biasesinitrange);
             }
 
             for (int subindex = 0; subindex < (embeddingSize * 4) * embeddingSize; subindex++){
-                layers[index].weights.feed_forward.shrink[subindex * 3] = random_range(weightsinitrange);
+                layers[index].weights.feed_forward.shrink[subindex] = random_range(weightsinitrange);
             }
 
             for (int subindex = 0; subindex < embeddingSize; subindex++){
-                layers[index].biases.feed_forward.shrink[subindex * 3] = random_range(biasesinitrange);
+                layers[index].biases.feed_forward.shrink[subindex] = random_range(biasesinitrange);
             }
 
             printf("Initalized layer %d/%d in %lldms.\n", index + 1, layersAmount, timer_end(timer__));
@@ -1986,29 +4601,13 @@ int main(int argc, char** argv){
 
         printf("Initalizing embeddings...\n");
         timer_ = timer();
-        embeddings = malloc((vocab_len + gap_size) * sizeof(float*));
-        if (!embeddings){
-            printf("Failed to allocate memory to initalize embeddings.\n");
-            return 1;
-        }
-
         for (int index = 0; index < vocab_len + gap_size; index++){
-            if (strcmp(id_to_tok[index], "PAD_NO_TOK_HERE") == 0){
-                embeddings[index] = NULL;
+            if (!id_to_token(index)){
                 continue;
             }
-            char* name = mname("embeddings[%d]", index);
-            if (!name){
-                return 1;
-            }
-            embeddings[index] = smalloc(embeddingSize * 3 * sizeof(float), name);
-            free(name);
-            if (!embeddings[index]){
-                printf("Failed to allocate memory to initalize embeddings.\n");
-                return 1;
-            }
+            float* row = embedding_row(index);
             for (int subindex = 0; subindex < embeddingSize; subindex++){
-                embeddings[index][subindex * 3] = random_range(embeddinginitrange);
+                row[subindex] = random_range(embeddinginitrange);
             }
         }
 
@@ -2017,40 +4616,21 @@ int main(int argc, char** argv){
         printf("Initalizing vocabulary projection weights and biases.\n");
         timer_ = timer();
         
-        char* name = mname("vocab_projection.weights");
-        if (!name){
-            return 1;
-        }
-        vocab_projection.weights = smalloc(vocab_len * embeddingSize * 3 * sizeof(float), name);
-        free(name);
-        name = mname("vocab_projection.biases");
-        if (!name){
-            return 1;
-        }
-        vocab_projection.biases = smalloc(vocab_len * 3 * sizeof(float), name);
-        free(name);
-        
-        if (!vocab_projection.weights){
-            printf("Failed memory allocation to initalize vocabulary projection.\n");
-            return 1;
-        }
-        if (!vocab_projection.biases){
-            printf("Failed memory allocation to initalize vocabulary projection.\n");
-            return 1;
-        }
-
         for (int index = 0; index < vocab_len * embeddingSize; index++){
-            vocab_projection.weights[index * 3] = random_range(weightsinitrange);
+            vocab_projection.weights[index] = random_range(weightsinitrange);
         }
         for (int index = 0; index < vocab_len; index++){
-            vocab_projection.biases[index * 3] = random_range(biasesinitrange);
+            vocab_projection.biases[index] = random_range(biasesinitrange);
         }
 
         printf("Initalized vocabulary projection weights and biases in %lldms.\n", timer_end(timer_));
         printf("Initalized model in %lldms.\n", timer_end(timer___));
+        if (!publish_manifest()){
+            return 1;
+        }
     }
     else{
-        if (load){
+        if (load && (!native_load)){
             printf("Opening model file (\"%s\").\n", model_location);
             long long timer_ = timer();
             mz_zip_archive zipfile;
@@ -2064,8 +4644,15 @@ int main(int argc, char** argv){
             int n_files = (int)(mz_zip_reader_get_num_files(&zipfile));
             printf("Loading model...\n");
             timer_ = timer();
+            //Only the names and sizes are read here. Entries are inflated when first looked up, or in parallel
+            //straight into the arena by load_indexed(), files_pending marks the ones not touched yet.
             char*** files = malloc(n_files * sizeof(char**));
             size_t* files_len = malloc(n_files * sizeof(size_t));
+            bool* files_pending = malloc(n_files * sizeof(bool));
+            if (!files_pending){
+                printf("Failed to allocate memory to load model.\n");
+                return 1;
+            }
             if (!files_len){
                 printf("Failed to allocate memory to load model.\n");
                 return 1;
@@ -2088,8 +4675,9 @@ int main(int argc, char** argv){
                     }
                     int filename_len = strlen(file_info.m_filename) + 1;
                     files[index][0] = malloc(filename_len);
-                    files[index][1] = malloc((size_t)(file_info.m_uncomp_size));
+                    files[index][1] = NULL;
                     files_len[index] = (size_t)(file_info.m_uncomp_size);
+                    files_pending[index] = true;
                 }
                 else{
                     printf("Model file is corrupted.\n");
@@ -2099,20 +4687,27 @@ int main(int argc, char** argv){
                     printf("Failed to allocate memory to load model.\n");
                     return 1;
                 }
+                
+                strcpy(files[index][0], file_info.m_filename);
+            }
+
+            //Inflates entry index into files if it wasn't yet, exits if it can't.
+            void extract_file(int index){
+                if (!files_pending[index]){
+                    return;
+                }
+                files_pending[index] = false;
+                files[index][1] = malloc(files_len[index]);
                 if (!files[index][1]){
                     printf("Failed to allocate memory to load model.\n");
-                    return 1;
+                    exit(1);
                 }
-                
-                strcpy(files[index][0], file_info.m_filename);
-                if (!mz_zip_reader_extract_to_mem(&zipfile, index, files[index][1], (size_t)(file_info.m_uncomp_size), 0)){
+                if (!mz_zip_reader_extract_to_mem(&zipfile, index, files[index][1], files_len[index], 0)){
                     printf("Model file is corrupted.\n");
-                    return 1;
+                    exit(1);
                 }
             }
 
-            mz_zip_reader_end(&zipfile);
-
             bool found_model_meta = false;
             int model_meta_index = -1;
 
@@ -2121,6 +4716,7 @@ int main(int argc, char** argv){
                 if (strcmp(files[index][0], "model_meta.json") == 0){
                     found_model_meta = true;
                     model_meta_index = index;
+                    extract_file(index);
                     
                     char* model_meta = realloc(files[index][1], files_len[index] + 1);
                     if (!model_meta){
@@ -2303,26 +4899,393 @@ int main(int argc, char** argv){
                 printf("Model file is corrupted.\n");
                 return 1;
             }
-            step_num = (int)(step_num_raw->valuedouble);
+            step_num = (int)(step_num_raw->valuedouble);
+
+            cJSON* layout_raw = cJSON_GetObjectItem(model_meta, "layout");
+            bool planar_checkpoint = cJSON_IsString(layout_raw) && strcmp(layout_raw->valuestring, "planar") == 0;
+
+            //Optional filters, see shuffle_bytes() and xor_floats().
+            bool shuffled_checkpoint = false;
+            cJSON* filter_raw = cJSON_GetObjectItem(model_meta, "filter");
+            if (filter_raw){
+                if ((!cJSON_IsString(filter_raw)) || (strcmp(filter_raw->valuestring, "shuffle") != 0) || (!planar_checkpoint)){
+                    printf("Model file is corrupted.\n");
+                    return 1;
+                }
+                shuffled_checkpoint = true;
+            }
+            //Inference only checkpoints carry the values alone, the moment planes aren't even allocated then.
+            cJSON* inference_only_raw = cJSON_GetObjectItem(model_meta, "inference_only");
+            if (inference_only_raw){
+                if (!cJSON_IsBool(inference_only_raw)){
+                    printf("Model file is corrupted.\n");
+                    return 1;
+                }
+                if (cJSON_IsTrue(inference_only_raw)){
+                    if (!planar_checkpoint){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    model_planes = 1;
+                }
+            }
+            if ((model_planes == 1) && (do_train || do_pretrain)){
+                printf("This model was exported for inference only, it has no adam moments to train with.\n");
+                return 1;
+            }
+
+            char* xor_base = NULL;
+            int xor_depth = 0;
+            cJSON* xor_base_raw = cJSON_GetObjectItem(model_meta, "xor_base");
+            if (xor_base_raw){
+                cJSON* xor_depth_raw = cJSON_GetObjectItem(model_meta, "xor_depth");
+                if ((!cJSON_IsString(xor_base_raw)) || (!planar_checkpoint) || (!cJSON_IsNumber(xor_depth_raw)) || (!isInt(xor_depth_raw->valuedouble)) || (xor_depth_raw->valuedouble < 1)){
+                    printf("Model file is corrupted.\n");
+                    return 1;
+                }
+                xor_base = resolve_base_path(xor_base_raw->valuestring, model_location);
+                if (!xor_base){
+                    printf("Failed to allocate memory to load model.\n");
+                    return 1;
+                }
+                xor_depth = (int)(xor_depth_raw->valuedouble);
+                printf("Model was saved as a difference to \"%s\", that file is needed too.\n", xor_base);
+            }
+
+            //Delta checkpoints leave out whatever didn't change since delta_base, see queue_rows().
+            char* delta_base = NULL;
+            int delta_depth = 0;
+            cJSON* delta_base_raw = cJSON_GetObjectItem(model_meta, "delta_base");
+            if (delta_base_raw){
+                cJSON* delta_depth_raw = cJSON_GetObjectItem(model_meta, "delta_depth");
+                if ((!cJSON_IsString(delta_base_raw)) || (!planar_checkpoint) || xor_base || (model_planes != 3) || (!cJSON_IsNumber(delta_depth_raw)) || (!isInt(delta_depth_raw->valuedouble)) || (delta_depth_raw->valuedouble < 1)){
+                    printf("Model file is corrupted.\n");
+                    return 1;
+                }
+                delta_base = resolve_base_path(delta_base_raw->valuestring, model_location);
+                if (!delta_base){
+                    printf("Failed to allocate memory to load model.\n");
+                    return 1;
+                }
+                delta_depth = (int)(delta_depth_raw->valuedouble);
+                printf("Model only holds what changed since \"%s\", that file is needed too.\n", delta_base);
+            }
+
+            cJSON* transformer_structure = cJSON_GetObjectItem(model_meta, "transformer_structure");
+            if (!cJSON_IsObject(transformer_structure)){
+                printf("Model file is corrupted.\n");
+                return 1;
+            }
+            cJSON* layers_raw = cJSON_GetObjectItem(transformer_structure, "layers");
+            if (!cJSON_IsArray(layers_raw)){
+                printf("Model file is corrupted.\n");
+                return 1;
+            }
+
+            if (layersAmount != cJSON_GetArraySize(layers_raw)){
+                printf("Model file is corrupted.\n");
+                return 1;
+            }
+            
+            //Entry names are hashed once (FNV-1a, open addressing) so finding a tensor's file doesn't scan the whole archive.
+            int files_index_cap = 1;
+            while (files_index_cap < n_files * 2){
+                files_index_cap *= 2;
+            }
+            int* files_index = malloc(files_index_cap * sizeof(int));
+            if (!files_index){
+                printf("Failed to allocate memory to load model.\n");
+                return 1;
+            }
+            for (int index = 0; index < files_index_cap; index++){
+                files_index[index] = -1;
+            }
+            uint32_t hash_name(const char* name){
+                uint32_t hash = 2166136261u;
+                for (; *name; name++){
+                    hash = (hash ^ (unsigned char)(*name)) * 16777619u;
+                }
+                return hash;
+            }
+            for (int index = 0; index < n_files; index++){
+                int slot = hash_name(files[index][0]) & (files_index_cap - 1);
+                while (files_index[slot] != -1){
+                    slot = (slot + 1) & (files_index_cap - 1);
+                }
+                files_index[slot] = index;
+            }
+            //Index of the entry called name whatever its state, -1 if there is none.
+            int lookup_file(const char* name){
+                int slot = hash_name(name) & (files_index_cap - 1);
+                while (files_index[slot] != -1){
+                    int index = files_index[slot];
+                    if (strcmp(files[index][0], name) == 0){
+                        return index;
+                    }
+                    slot = (slot + 1) & (files_index_cap - 1);
+                }
+                return -1;
+            }
+
+            //Index of the file called name with its data inflated, -1 if there is none or it was already loaded.
+            int find_file(const char* name){
+                int index = lookup_file(name);
+                if (index == -1){
+                    return -1;
+                }
+                extract_file(index);
+                return files[index][1] ? index : -1;
+            }
+
+            //Checkpoints a XORed or delta checkpoint refers to, opened once and kept until the load is done.
+            typedef struct {
+                char* path;
+                mz_zip_archive zip;
+                bool shuffled;
+                char* xor_base; //resolved against path, see resolve_base_path()
+                char* delta_base; //same
+                cJSON* meta;
+            } base_checkpoint;
+            base_checkpoint** bases = NULL; //pointers, miniz keeps a pointer to each mz_zip_archive so they can't move
+            int bases_len = 0;
+
+            base_checkpoint* open_base(char* path){
+                for (int index = 0; index < bases_len; index++){
+                    if (same_file(bases[index]->path, path)){
+                        return bases[index];
+                    }
+                }
+                base_checkpoint** tmp = realloc(bases, (bases_len + 1) * sizeof(base_checkpoint*));
+                if (!tmp){
+                    printf("Failed to allocate memory to load model.\n");
+                    return NULL;
+                }
+                bases = tmp;
+                base_checkpoint* base = calloc(1, sizeof(base_checkpoint));
+                if (!base){
+                    printf("Failed to allocate memory to load model.\n");
+                    return NULL;
+                }
+                if (!mz_zip_reader_init_file(&base->zip, path, 0)){
+                    printf("Failed to open \"%s\", the model was saved as a difference to it.\n", path);
+                    return NULL;
+                }
+                size_t meta_len;
+                char* meta_text = mz_zip_reader_extract_file_to_heap(&base->zip, "model_meta.json", &meta_len, 0);
+                if (!meta_text){
+                    printf("Model file \"%s\" is corrupted.\n", path);
+                    return NULL;
+                }
+                base->meta = cJSON_ParseWithLength(meta_text, meta_len);
+                mz_free(meta_text);
+                cJSON* base_layout = cJSON_GetObjectItem(base->meta, "layout");
+                if ((!base->meta) || (!cJSON_IsString(base_layout)) || (strcmp(base_layout->valuestring, "planar") != 0)){
+                    printf("Model file \"%s\" is corrupted.\n", path);
+                    return NULL;
+                }
+                base->shuffled = cJSON_IsString(cJSON_GetObjectItem(base->meta, "filter"));
+                cJSON* base_xor = cJSON_GetObjectItem(base->meta, "xor_base");
+                base->xor_base = cJSON_IsString(base_xor) ? resolve_base_path(base_xor->valuestring, path) : NULL;
+                cJSON* base_delta = cJSON_GetObjectItem(base->meta, "delta_base");
+                base->delta_base = cJSON_IsString(base_delta) ? resolve_base_path(base_delta->valuestring, path) : NULL;
+                if ((cJSON_IsString(base_xor) && (!base->xor_base)) || (cJSON_IsString(base_delta) && (!base->delta_base))){
+                    printf("Failed to allocate memory to load model.\n");
+                    return NULL;
+                }
+                base->path = malloc(strlen(path) + 1);
+                if (!base->path){
+                    printf("Failed to allocate memory to load model.\n");
+                    return NULL;
+                }
+                strcpy(base->path, path);
+                bases[bases_len++] = base;
+                return base;
+            }
+
+            auto bool read_from_base(char* path, const char* name, float** planes, size_t count, int depth);
+
+            //Undoes the filters on planes (value, m and v, count floats each) in place, reading base checkpoints as needed.
+            bool unfilter_planes(float** planes, size_t count, bool shuffled, char* base_path, const char* name, int depth){
+                if (base_path && (model_planes != 3)){
+                    printf("Model file is corrupted.\n");
+                    return false;
+                }
+                if (depth > 1024){
+                    printf("Model file is corrupted.\n");
+                    return false;
+                }
+                if (shuffled){
+                    float* tmp = malloc(count * sizeof(float));
+                    if (!tmp){
+                        printf("Failed to allocate memory to load model.\n");
+                        return false;
+                    }
+                    for (int plane = 0; plane < model_planes; plane++){
+                        unshuffle_bytes(tmp, planes[plane], count);
+                        memcpy(planes[plane], tmp, count * sizeof(float));
+                    }
+                    free(tmp);
+                }
+                if (!base_path){
+                    return true;
+                }
+                float* ref = malloc(count * 3 * sizeof(float));
+                if (!ref){
+                    printf("Failed to allocate memory to load model.\n");
+                    return false;
+                }
+                float* ref_planes[3] = {ref, ref + count, ref + count * 2};
+                bool ok = read_from_base(base_path, name, ref_planes, count, depth + 1);
+                if (ok){
+                    for (int plane = 0; plane < 3; plane++){
+                        xor_floats(planes[plane], planes[plane], ref_planes[plane], count);
+                    }
+                }
+                free(ref);
+                return ok;
+            }
+
+            //Copies the rows a delta checkpoint saved over planes. ids lists them, data holds their value, m and v blocks back to back.
+            bool overlay_rows(float** planes, size_t count, const int32_t* ids, size_t ids_size, float* data, size_t data_size, bool shuffled){
+                size_t rows = ids_size / sizeof(int32_t);
+                size_t row_len = embeddingSize;
+                if ((ids_size % sizeof(int32_t) != 0) || (data_size != rows * row_len * 3 * sizeof(float))){
+                    printf("Model file is corrupted.\n");
+                    return false;
+                }
+                float* data_planes[3] = {data, data + rows * row_len, data + rows * row_len * 2};
+                if (!unfilter_planes(data_planes, rows * row_len, shuffled, NULL, NULL, 0)){
+                    return false;
+                }
+                for (size_t index = 0; index < rows; index++){
+                    if ((ids[index] < 0) || ((size_t)(ids[index]) >= count / row_len)){
+                        printf("Model file is corrupted.\n");
+                        return false;
+                    }
+                    for (int plane = 0; plane < 3; plane++){
+                        memcpy(planes[plane] + ids[index] * row_len, data_planes[plane] + index * row_len, row_len * sizeof(float));
+                    }
+                }
+                return true;
+            }
+
+            //Reads tensor name as it is in the checkpoint at path into planes (value, m and v, count floats each),
+            //going through that checkpoint's own delta or XOR base when it needs one.
+            bool read_from_base(char* path, const char* name, float** planes, size_t count, int depth){
+                if (depth > 1024){
+                    printf("Model file is corrupted.\n");
+                    return false;
+                }
+                base_checkpoint* base = open_base(path);
+                if (!base){
+                    return false;
+                }
+                char rows_name[strlen(name) + strlen(".rows") + 1];
+                sprintf(rows_name, "%s.rows", name);
+                bool has_tensor = mz_zip_reader_locate_file(&base->zip, name, NULL, 0) >= 0;
+                bool has_rows = base->delta_base && (mz_zip_reader_locate_file(&base->zip, rows_name, NULL, 0) >= 0);
+                if ((!has_tensor) || has_rows){
+                    if (!base->delta_base){
+                        printf("Model file \"%s\" is corrupted.\n", path);
+                        return false;
+                    }
+                    if (!read_from_base(base->delta_base, name, planes, count, depth + 1)){
+                        return false;
+                    }
+                    if (!has_tensor){
+                        return true;
+                    }
+                }
+                size_t size;
+                float* data = mz_zip_reader_extract_file_to_heap(&base->zip, name, &size, 0);
+                if (!data){
+                    printf("Model file \"%s\" is corrupted.\n", path);
+                    return false;
+                }
+                bool ok = false;
+                if (has_rows){
+                    size_t ids_size;
+                    int32_t* ids = mz_zip_reader_extract_file_to_heap(&base->zip, rows_name, &ids_size, 0);
+                    ok = ids && overlay_rows(planes, count, ids, ids_size, data, size, base->shuffled);
+                    mz_free(ids);
+                }
+                else{
+                    if (size == count * 3 * sizeof(float)){
+                        for (int plane = 0; plane < 3; plane++){
+                            memcpy(planes[plane], data + count * plane, count * sizeof(float));
+                        }
+                        ok = unfilter_planes(planes, count, base->shuffled, base->xor_base, name, depth + 1);
+                    }
+                    else{
+                        printf("Model file \"%s\" is corrupted.\n", path);
+                    }
+                }
+                mz_free(data);
+                return ok;
+            }
 
-            cJSON* transformer_structure = cJSON_GetObjectItem(model_meta, "transformer_structure");
-            if (!cJSON_IsObject(transformer_structure)){
-                printf("Model file is corrupted.\n");
-                return 1;
-            }
-            cJSON* layers_raw = cJSON_GetObjectItem(transformer_structure, "layers");
-            if (!cJSON_IsArray(layers_raw)){
-                printf("Model file is corrupted.\n");
-                return 1;
-            }
+            //Fills dst (count floats and their adam moments) from the given files back to back, name is the tensor's first file.
+            void load_files(int* files_indexes, int total_files, size_t total_files_size, float* dst, size_t count, const char* name){
+                //Checkpoints older than the arena didn't store whole embedding rows, whatever is missing stays zeroed.
+                if (total_files_size > count * model_planes * sizeof(float)){
+                    printf("Model file is corrupted.\n");
+                    exit(1);
+                }
+                if (planar_checkpoint && total_files_size != count * model_planes * sizeof(float)){
+                    printf("Model file is corrupted.\n");
+                    exit(1);
+                }
+                float* planes[3] = {dst, NULL, NULL};
+                if (model_planes == 3){
+                    planes[1] = adam_m(dst);
+                    planes[2] = adam_v(dst);
+                }
+                size_t curr_w = 0; //in floats
+                for (int index = 0; index < total_files; index++){
+                    float* src = (float*)(files[files_indexes[index]][1]);
+                    size_t src_len = files_len[files_indexes[index]] / sizeof(float);
+                    if (planar_checkpoint){
+                        //value, m and v blocks back to back, a block may span several files.
+                        size_t done = 0;
+                        while (done < src_len){
+                            size_t plane = (curr_w + done) / count;
+                            size_t at = (curr_w + done) % count;
+                            size_t run = count - at;
+                            if (run > src_len - done){
+                                run = src_len - done;
+                            }
+                            memcpy(planes[plane] + at, src + done, run * sizeof(float));
+                            done += run;
+                        }
+                    }
+                    else{
+                        //Older checkpoints interleave value, m and v for every float.
+                        for (size_t subindex = 0; subindex < src_len; subindex++){
+                            planes[(curr_w + subindex) % 3][(curr_w + subindex) / 3] = src[subindex];
+                        }
+                    }
+                    free(files[files_indexes[index]][1]); //the name stays for find_file()
+                    files[files_indexes[index]][1] = NULL;
 
-            if (layersAmount != cJSON_GetArraySize(layers_raw)){
-                printf("Model file is corrupted.\n");
-                return 1;
+                    curr_w += src_len;
+                }
+
+                if (shuffled_checkpoint || xor_base){
+                    //Filtered checkpoints are written one file per tensor, so the first path names it in the base too.
+                    if (total_files != 1){
+                        printf("Model file is corrupted.\n");
+                        exit(1);
+                    }
+                    if (!unfilter_planes(planes, count, shuffled_checkpoint, xor_base, name, 0)){
+                        exit(1);
+                    }
+                }
             }
-            
-            float* loadFloats(cJSON* patharr, char* allocname){
-                if (!allocname){
+
+            //Copies the files listed in patharr back to back into dst, which holds count floats (with their adam moments).
+            void loadFloats(cJSON* patharr, float* dst, size_t count){
+                if (!dst){
+                    printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
                     exit(1);
                 }
                 if (!cJSON_IsArray(patharr)){
@@ -2346,353 +5309,487 @@ int main(int argc, char** argv){
                         printf("Model file is corrupted.\n");
                         exit(1);
                     }
-                    bool found = false;
-                    for (int subindex = 0; subindex < n_files; subindex++){
-                        if (!files[subindex][0]){
-                            continue;
-                        }
-                        if (strcmp(item->valuestring, files[subindex][0]) == 0){
-                            found = true;
-                            total_files_size += files_len[subindex];
-                            files_indexes[index] = subindex;
-                            total_files++;
-                            break;
-                        }
-                    }
-                    if (!found){
+                    int subindex = find_file(item->valuestring);
+                    if (subindex == -1){
                         printf("Model file is corrupted.\n");
                         exit(1);
                     }
+                    total_files_size += files_len[subindex];
+                    files_indexes[index] = subindex;
+                    total_files++;
                 }
-
-                float* floatarr = smalloc(total_files_size, allocname);
-                free(allocname);
-                if (!floatarr){
-                    printf("Failed to allocate memory to load model.\n");
-                    exit(1);
-                }
-                size_t curr_w = 0;
-                for (int index = 0; index < total_files; index++){
-                    //Chars are only one byte and we wanna count in bytes here therefore let's make c
-                    //shut the fuck up.
-                    memcpy(((char*)floatarr) + curr_w, files[files_indexes[index]][1], files_len[files_indexes[index]]);
-                    free(files[files_indexes[index]][0]);
-                    free(files[files_indexes[index]][1]);
-                    files[files_indexes[index]][0] = NULL;
-                    files[files_indexes[index]][1] = NULL;
-
-                    curr_w += files_len[files_indexes[index]];
-                }
-
+                load_files(files_indexes, total_files, total_files_size, dst, count, cJSON_GetArrayItem(patharr, 0)->valuestring);
                 free(files_indexes);
-
-                return floatarr;
             }
 
-            layers = malloc(layersAmount * sizeof(layer));
-            if (!layers){
-                printf("Failed memory allocation to load model.\n");
-                return 1;
+            //Checks the dense embeddings table described by embeddings_raw against the vocabulary.
+            bool check_embedding_ids(cJSON* embeddings_raw){
+                cJSON* rows_raw = cJSON_GetObjectItem(embeddings_raw, "rows");
+                if ((!cJSON_IsNumber(rows_raw)) || (!isInt(rows_raw->valuedouble))){
+                    printf("Model file is corrupted.\n");
+                    return false;
+                }
+                if ((int)(rows_raw->valuedouble) != vocab_len + gap_size){
+                    printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
+                    return false;
+                }
+                cJSON* ids_raw = cJSON_GetObjectItem(embeddings_raw, "ids");
+                if (ids_raw){
+                    if (!cJSON_IsString(ids_raw)){
+                        printf("Model file is corrupted.\n");
+                        return false;
+                    }
+                    int ids_file = find_file(ids_raw->valuestring);
+                    if ((ids_file == -1) || (files_len[ids_file] % sizeof(int32_t) != 0)){
+                        printf("Model file is corrupted.\n");
+                        return false;
+                    }
+                    int32_t* saved_ids = (int32_t*)(files[ids_file][1]);
+                    int saved_ids_len = files_len[ids_file] / sizeof(int32_t);
+                    if (saved_ids_len != vocab_len){
+                        printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
+                        return false;
+                    }
+                    for (int index = 0; index < saved_ids_len; index++){
+                        if (!id_to_token(saved_ids[index])){
+                            printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
+                            return false;
+                        }
+                    }
+                }
+                return true;
             }
 
-            for (int index = 0; index < cJSON_GetArraySize(layers_raw); index++){
-                cJSON* layer_curr = cJSON_GetArrayItem(layers_raw, index);
-                if (!cJSON_IsObject(layer_curr)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+            //Loads one tensor of the checkpoint, a delta checkpoint gets what it left out of it from its base.
+            void load_entry(const char* name, float* dst, size_t count){
+                int file = find_file(name);
+                int rows_file = -1;
+                if (delta_base){
+                    char rows_name[strlen(name) + strlen(".rows") + 1];
+                    sprintf(rows_name, "%s.rows", name);
+                    rows_file = find_file(rows_name);
                 }
-                cJSON* weights_lc = cJSON_GetObjectItem(layer_curr, "weights");
-                if (!cJSON_IsObject(weights_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+                if ((file != -1) && (rows_file == -1)){
+                    load_files(&file, 1, files_len[file], dst, count, name);
+                    return;
                 }
-                cJSON* normalize_1_lc = cJSON_GetObjectItem(weights_lc, "normalize_1");
-                if (!cJSON_IsArray(normalize_1_lc)){
+                if ((!delta_base) || ((rows_file != -1) && (file == -1))){
                     printf("Model file is corrupted.\n");
-                    return 1;
+                    exit(1);
                 }
-                layers[index].weights.normalize_1 = loadFloats(normalize_1_lc, mname("layers[%d].weights.normalize_1", index));
-                
-                cJSON* normalize_2_lc = cJSON_GetObjectItem(weights_lc, "normalize_2");
-                if (!cJSON_IsArray(normalize_2_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+                float* planes[3] = {dst, adam_m(dst), adam_v(dst)};
+                if (!read_from_base(delta_base, name, planes, count, 0)){
+                    exit(1);
                 }
-                layers[index].weights.normalize_2 = loadFloats(normalize_2_lc, mname("layers[%d].weights.normalize_2", index));
-
-                cJSON* attention_lc = cJSON_GetObjectItem(weights_lc, "attention");
-                if (!cJSON_IsObject(attention_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+                if (rows_file != -1){
+                    bool ok = overlay_rows(planes, count, (int32_t*)(files[rows_file][1]), files_len[rows_file], (float*)(files[file][1]), files_len[file], shuffled_checkpoint);
+                    free(files[rows_file][1]);
+                    files[rows_file][1] = NULL;
+                    free(files[file][1]);
+                    files[file][1] = NULL;
+                    if (!ok){
+                        exit(1);
+                    }
                 }
+            }
 
-                cJSON* heads_lc = cJSON_GetObjectItem(attention_lc, "heads");
-                if (!cJSON_IsArray(heads_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+            //Loads every tensor through tensors.idx. False, with nothing loaded, if there is no index or it was written for another layout.
+            bool load_indexed(){
+                int index_file = find_file("tensors.idx");
+                cJSON* embeddings_raw = cJSON_GetObjectItem(transformer_structure, "embeddings");
+                if ((index_file == -1) || (!planar_checkpoint) || (!cJSON_IsObject(embeddings_raw))){
+                    return false;
                 }
-
-                if (cJSON_GetArraySize(heads_lc) != heads){
+                const char* data = files[index_file][1];
+                size_t len = files_len[index_file];
+                tensor_index_header header;
+                if (len < sizeof header){
+                    return false;
+                }
+                memcpy(&header, data, sizeof header);
+                if ((memcmp(header.magic, TENSOR_INDEX_MAGIC, 8) != 0) || (header.layout_hash != layout_hash()) || (header.plane_size != plane_size)){
+                    return false;
+                }
+                size_t entry_size = sizeof(uint64_t) * 2 + sizeof(uint16_t);
+                size_t model_floats = 0;
+                for (int index = 0; index < tensor_table_len; index++){
+                    model_floats += tensor_table[index].size / sizeof(float);
+                }
+
+                //Everything is checked before the first tensor is loaded so the paths in model_meta.json stay usable.
+                inflate_job* jobs = NULL;
+                int jobs_len = 0;
+                for (int pass = 0; pass < 2; pass++){
+                    if (pass == 1){
+                        jobs = malloc(header.count * sizeof(inflate_job));
+                        if (!jobs){
+                            printf("Failed to allocate memory to load model.\n");
+                            exit(1);
+                        }
+                    }
+                    size_t at = sizeof header;
+                    size_t covered = 0;
+                    for (uint32_t index = 0; index < header.count; index++){
+                        uint64_t offset;
+                        uint64_t count;
+                        uint16_t name_len;
+                        if (len - at < entry_size){
+                            return false;
+                        }
+                        memcpy(&offset, data + at, sizeof offset);
+                        memcpy(&count, data + at + sizeof offset, sizeof count);
+                        memcpy(&name_len, data + at + sizeof offset + sizeof count, sizeof name_len);
+                        at += entry_size;
+                        if (len - at < name_len){
+                            return false;
+                        }
+                        if ((offset % sizeof(float) != 0) || (offset > plane_size) || (count > (plane_size - offset) / sizeof(float))){
+                            return false;
+                        }
+                        if (pass == 1){
+                            char name[name_len + 1];
+                            memcpy(name, data + at, name_len);
+                            name[name_len] = '\0';
+                            float* dst = (float*)(arena + offset);
+                            int file = lookup_file(name);
+                            char rows_name[name_len + strlen(".rows") + 1];
+                            sprintf(rows_name, "%s.rows", name);
+                            //Whole tensors that need nothing from another checkpoint are inflated in parallel once all are listed, the rest right away.
+                            if ((file != -1) && files_pending[file] && (!xor_base) && (lookup_file(rows_name) == -1) && (files_len[file] == count * model_planes * sizeof(float))){
+                                files_pending[file] = false;
+                                inflate_job* job = &jobs[jobs_len++];
+                                job->file = file;
+                                job->planes = model_planes;
+                                job->parts[0] = dst;
+                                if (model_planes == 3){
+                                    job->parts[1] = adam_m(dst);
+                                    job->parts[2] = adam_v(dst);
+                                }
+                                job->part_size = count * sizeof(float);
+                                job->shuffled = shuffled_checkpoint;
+                            }
+                            else{
+                                load_entry(name, dst, count);
+                            }
+                        }
+                        at += name_len;
+                        covered += count;
+                    }
+                    if ((at != len) || (covered != model_floats)){
+                        return false;
+                    }
+                    if ((pass == 0) && (!check_embedding_ids(embeddings_raw))){
+                        exit(1);
+                    }
+                }
+                if (!inflate_all(model_location, jobs, jobs_len)){
                     printf("Model file is corrupted.\n");
-                    return 1;
+                    exit(1);
                 }
+                free(jobs);
+                return true;
+            }
 
-                layers[index].weights.attention.heads = malloc(heads * sizeof(*layers[index].weights.attention.heads));
-                if (!layers[index].weights.attention.heads){
-                    printf("Failed to allocate memory to load model.\n");
+            if (!create_model_arena()){
+                return 1;
+            }
+
+            //Checkpoints with a tensor index load straight from it, the paths in transformer_structure are for older files.
+            if (!load_indexed()){
+                if (delta_base){
+                    printf("Model file is corrupted.\n");
                     return 1;
                 }
-
-                for (int subindex = 0; subindex < heads; subindex++){
-                    if (!cJSON_IsObject(cJSON_GetArrayItem(heads_lc, subindex))){
+                for (int index = 0; index < cJSON_GetArraySize(layers_raw); index++){
+                    cJSON* layer_curr = cJSON_GetArrayItem(layers_raw, index);
+                    if (!cJSON_IsObject(layer_curr)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    cJSON* query_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "query");
-                    cJSON* key_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "key");
-                    cJSON* value_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "value");
-                    if (!cJSON_IsArray(query_lh_lc)){
+                    cJSON* weights_lc = cJSON_GetObjectItem(layer_curr, "weights");
+                    if (!cJSON_IsObject(weights_lc)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    if (!cJSON_IsArray(key_lh_lc)){
+                    cJSON* normalize_1_lc = cJSON_GetObjectItem(weights_lc, "normalize_1");
+                    if (!cJSON_IsArray(normalize_1_lc)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    if (!cJSON_IsArray(value_lh_lc)){
+                    loadFloats(normalize_1_lc, layers[index].weights.normalize_1, embeddingSize);
+                
+                    cJSON* normalize_2_lc = cJSON_GetObjectItem(weights_lc, "normalize_2");
+                    if (!cJSON_IsArray(normalize_2_lc)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    layers[index].weights.attention.heads[subindex].query = loadFloats(query_lh_lc, mname("layers[%d].weights.attention.heads[%d].query", index, subindex));
-                    layers[index].weights.attention.heads[subindex].key = loadFloats(key_lh_lc, mname("layers[%d].weights.attention.heads[%d].key", index, subindex));
-                    layers[index].weights.attention.heads[subindex].value = loadFloats(value_lh_lc, mname("layers[%d].weights.attention.heads[%d].value", index, subindex));
-                }
-                
-                cJSON* attn_o_lc = cJSON_GetObjectItem(attention_lc, "output");
-                if (!cJSON_IsArray(attn_o_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                layers[index].weights.attention.output = loadFloats(attn_o_lc, mname("layers[%d].weights.attention.output", index));
-
-                cJSON* ffw_lc = cJSON_GetObjectItem(weights_lc, "feed_forward");
-                if (!cJSON_IsObject(ffw_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
+                    loadFloats(normalize_2_lc, layers[index].weights.normalize_2, embeddingSize);
 
-                cJSON* ffw_grow_lc = cJSON_GetObjectItem(ffw_lc, "grow");
-                cJSON* ffw_shrink_lc = cJSON_GetObjectItem(ffw_lc, "shrink");
-                if (!cJSON_IsArray(ffw_grow_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                if (!cJSON_IsArray(ffw_shrink_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                layers[index].weights.feed_forward.grow = loadFloats(ffw_grow_lc, mname("layers[%d].weights.feed_forward.grow", index));
-                layers[index].weights.feed_forward.shrink = loadFloats(ffw_shrink_lc, mname("layers[%d].weights.feed_forward.shrink", index));
+                    cJSON* attention_lc = cJSON_GetObjectItem(weights_lc, "attention");
+                    if (!cJSON_IsObject(attention_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
 
+                    cJSON* heads_lc = cJSON_GetObjectItem(attention_lc, "heads");
+                    if (!cJSON_IsArray(heads_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
 
-                weights_lc = cJSON_GetObjectItem(layer_curr, "biases");
-                if (!cJSON_IsObject(weights_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                normalize_1_lc = cJSON_GetObjectItem(weights_lc, "normalize_1");
-                if (!cJSON_IsArray(normalize_1_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                layers[index].biases.normalize_1 = loadFloats(normalize_1_lc, mname("layers[%d].biases.normalize_1", index));
+                    if (cJSON_GetArraySize(heads_lc) != heads){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
 
-                normalize_2_lc = cJSON_GetObjectItem(weights_lc, "normalize_2");
-                if (!cJSON_IsArray(normalize_2_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                layers[index].biases.normalize_2 = loadFloats(normalize_2_lc, mname("layers[%d].biases.normalize_2", index));
+                    for (int subindex = 0; subindex < heads; subindex++){
+                        if (!cJSON_IsObject(cJSON_GetArrayItem(heads_lc, subindex))){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        cJSON* query_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "query");
+                        cJSON* key_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "key");
+                        cJSON* value_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "value");
+                        if (!cJSON_IsArray(query_lh_lc)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        if (!cJSON_IsArray(key_lh_lc)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        if (!cJSON_IsArray(value_lh_lc)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        loadFloats(query_lh_lc, layers[index].weights.attention.heads[subindex].query, embeddingSize * embeddingSize);
+                        loadFloats(key_lh_lc, layers[index].weights.attention.heads[subindex].key, embeddingSize * embeddingSize);
+                        loadFloats(value_lh_lc, layers[index].weights.attention.heads[subindex].value, embeddingSize * embeddingSize);
+                    }
+                
+                    cJSON* attn_o_lc = cJSON_GetObjectItem(attention_lc, "output");
+                    if (!cJSON_IsArray(attn_o_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    loadFloats(attn_o_lc, layers[index].weights.attention.output, embeddingSize * (embeddingSize * heads));
 
-                attention_lc = cJSON_GetObjectItem(weights_lc, "attention");
-                if (!cJSON_IsObject(attention_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
+                    cJSON* ffw_lc = cJSON_GetObjectItem(weights_lc, "feed_forward");
+                    if (!cJSON_IsObject(ffw_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
 
-                heads_lc = cJSON_GetObjectItem(attention_lc, "heads");
-                if (!cJSON_IsArray(heads_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
+                    cJSON* ffw_grow_lc = cJSON_GetObjectItem(ffw_lc, "grow");
+                    cJSON* ffw_shrink_lc = cJSON_GetObjectItem(ffw_lc, "shrink");
+                    if (!cJSON_IsArray(ffw_grow_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    if (!cJSON_IsArray(ffw_shrink_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    loadFloats(ffw_grow_lc, layers[index].weights.feed_forward.grow, embeddingSize * (embeddingSize * 4));
+                    loadFloats(ffw_shrink_lc, layers[index].weights.feed_forward.shrink, embeddingSize * (embeddingSize * 4));
 
-                if (cJSON_GetArraySize(heads_lc) != heads){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
 
-                layers[index].biases.attention.heads = malloc(heads * sizeof(*layers[index].biases.attention.heads));
-                if (!layers[index].biases.attention.heads){
-                    printf("Failed to allocate memory to load model.\n");
-                    return 1;
-                }
+                    weights_lc = cJSON_GetObjectItem(layer_curr, "biases");
+                    if (!cJSON_IsObject(weights_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    normalize_1_lc = cJSON_GetObjectItem(weights_lc, "normalize_1");
+                    if (!cJSON_IsArray(normalize_1_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    loadFloats(normalize_1_lc, layers[index].biases.normalize_1, embeddingSize);
 
-                for (int subindex = 0; subindex < heads; subindex++){
-                    if (!cJSON_IsObject(cJSON_GetArrayItem(heads_lc, subindex))){
+                    normalize_2_lc = cJSON_GetObjectItem(weights_lc, "normalize_2");
+                    if (!cJSON_IsArray(normalize_2_lc)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    cJSON* query_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "query");
-                    cJSON* key_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "key");
-                    cJSON* value_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "value");
-                    if (!cJSON_IsArray(query_lh_lc)){
+                    loadFloats(normalize_2_lc, layers[index].biases.normalize_2, embeddingSize);
+
+                    attention_lc = cJSON_GetObjectItem(weights_lc, "attention");
+                    if (!cJSON_IsObject(attention_lc)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    if (!cJSON_IsArray(key_lh_lc)){
+
+                    heads_lc = cJSON_GetObjectItem(attention_lc, "heads");
+                    if (!cJSON_IsArray(heads_lc)){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    if (!cJSON_IsArray(value_lh_lc)){
+
+                    if (cJSON_GetArraySize(heads_lc) != heads){
                         printf("Model file is corrupted.\n");
                         return 1;
                     }
-                    layers[index].biases.attention.heads[subindex].query = loadFloats(query_lh_lc, mname("layers[%d].biases.attention.heads[%d].query", index, subindex));
-                    layers[index].biases.attention.heads[subindex].key = loadFloats(key_lh_lc, mname("layers[%d].biases.attention.heads[%d].key", index, subindex));
-                    layers[index].biases.attention.heads[subindex].value = loadFloats(value_lh_lc, mname("layers[%d].biases.attention.heads[%d].value", index, subindex));
-                }
 
-                attn_o_lc = cJSON_GetObjectItem(attention_lc, "output");
-                if (!cJSON_IsArray(attn_o_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
-                layers[index].biases.attention.output = loadFloats(attn_o_lc, mname("layers[%d].biases.attention.output", index));
+                    for (int subindex = 0; subindex < heads; subindex++){
+                        if (!cJSON_IsObject(cJSON_GetArrayItem(heads_lc, subindex))){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        cJSON* query_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "query");
+                        cJSON* key_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "key");
+                        cJSON* value_lh_lc = cJSON_GetObjectItem(cJSON_GetArrayItem(heads_lc, subindex), "value");
+                        if (!cJSON_IsArray(query_lh_lc)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        if (!cJSON_IsArray(key_lh_lc)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        if (!cJSON_IsArray(value_lh_lc)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        loadFloats(query_lh_lc, layers[index].biases.attention.heads[subindex].query, embeddingSize);
+                        loadFloats(key_lh_lc, layers[index].biases.attention.heads[subindex].key, embeddingSize);
+                        loadFloats(value_lh_lc, layers[index].biases.attention.heads[subindex].value, embeddingSize);
+                    }
 
-                ffw_lc = cJSON_GetObjectItem(weights_lc, "feed_forward");
-                if (!cJSON_IsObject(ffw_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
-                }
+                    attn_o_lc = cJSON_GetObjectItem(attention_lc, "output");
+                    if (!cJSON_IsArray(attn_o_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    loadFloats(attn_o_lc, layers[index].biases.attention.output, embeddingSize);
 
-                ffw_grow_lc = cJSON_GetObjectItem(ffw_lc, "grow");
-                ffw_shrink_lc = cJSON_GetObjectItem(ffw_lc, "shrink");
-                if (!cJSON_IsArray(ffw_grow_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+                    ffw_lc = cJSON_GetObjectItem(weights_lc, "feed_forward");
+                    if (!cJSON_IsObject(ffw_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+
+                    ffw_grow_lc = cJSON_GetObjectItem(ffw_lc, "grow");
+                    ffw_shrink_lc = cJSON_GetObjectItem(ffw_lc, "shrink");
+                    if (!cJSON_IsArray(ffw_grow_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    if (!cJSON_IsArray(ffw_shrink_lc)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    loadFloats(ffw_grow_lc, layers[index].biases.feed_forward.grow, embeddingSize * 4);
+                    loadFloats(ffw_shrink_lc, layers[index].biases.feed_forward.shrink, embeddingSize);
                 }
-                if (!cJSON_IsArray(ffw_shrink_lc)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+                cJSON* embeddings_raw = cJSON_GetObjectItem(transformer_structure, "embeddings");
+                if (cJSON_IsObject(embeddings_raw)){
+                    //One dense table, see save().
+                    if (!check_embedding_ids(embeddings_raw)){
+                        return 1;
+                    }
+                    loadFloats(cJSON_GetObjectItem(embeddings_raw, "table"), embeddings, (size_t)(vocab_len + gap_size) * embeddingSize);
                 }
-                layers[index].biases.feed_forward.grow = loadFloats(ffw_grow_lc, mname("layers[%d].biases.feed_forward.grow", index));
-                layers[index].biases.feed_forward.shrink = loadFloats(ffw_shrink_lc, mname("layers[%d].biases.feed_forward.shrink", index));
-            }
-            cJSON* embeddings_raw = cJSON_GetObjectItem(transformer_structure, "embeddings");
-            if (!cJSON_IsArray(embeddings_raw)){
-                printf("Model file is corrupted.\n");
-                return 1;
-            }
-            int embeddings_raw_size = cJSON_GetArraySize(embeddings_raw);
-            if (embeddings_raw_size != vocab_len){
-                printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
-                return 1;
-            }
-            cJSON* curr_embedding_raw_item = cJSON_GetArrayItem(embeddings_raw, 0);
+                else{
+                    if (!cJSON_IsArray(embeddings_raw)){
+                        printf("Model file is corrupted.\n");
+                        return 1;
+                    }
+                    int embeddings_raw_size = cJSON_GetArraySize(embeddings_raw);
+                    if (embeddings_raw_size != vocab_len){
+                        printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
+                        return 1;
+                    }
+                    cJSON* curr_embedding_raw_item = cJSON_GetArrayItem(embeddings_raw, 0);
 
-            embeddings = calloc((vocab_len + gap_size) * sizeof(float*), 1);
-            if (!embeddings){
-                printf("Failed to allocate memory to load model.\n");
-                return 1;
-            }
+                    char* digits = malloc(11);
+                    if (!digits){
+                        printf("Failed memory allocation to load model.\n");
+                        return 1;
+                    }
+                    strcpy(digits, "0123456789");
+
+                    for (int index = 0; index < embeddings_raw_size; index++){
+                        if (!cJSON_IsArray(curr_embedding_raw_item)){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        //get id from filename
+                        //we will hope id is consistent and the first number in the str of the filename.
+                        if (!cJSON_IsString(cJSON_GetArrayItem(curr_embedding_raw_item, 0))){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        int curr_embedding_raw_item_filename_len = strlen(cJSON_GetArrayItem(curr_embedding_raw_item, 0)->valuestring);
+                        if (curr_embedding_raw_item_filename_len == 0){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        char* num_ = malloc(32);
+                        bool foundid = false;
+                
+                        if (!num_){
+                            printf("Failed to allocate memory to load model.\n");
+                            return 1;
+                        }
+                        int cursor_ = 0;
+                        for (int subindex = 0; subindex < curr_embedding_raw_item_filename_len; subindex++){
+                            char currchr = cJSON_GetArrayItem(curr_embedding_raw_item, 0)->valuestring[subindex];
+                            bool isdigit = false;
+                            for (int subsubindex = 0; subsubindex < 10; subsubindex++){
+                                if (digits[subsubindex] == currchr){
+                                    isdigit = true;
+                                    foundid = true;
+                                    break;
+                                }
+                            }
+                            if (!isdigit){
+                                if (foundid){
+                                    break;
+                                }
+                            }
+                            else{
+                                if (cursor_ < 31){
+                                    num_[cursor_] = currchr;
+                                    cursor_++;
+                                }
+                            }
+                        }
+                        if (!foundid){
+                            printf("Model file is corrupted.\n");
+                            return 1;
+                        }
+                        num_[cursor_] = '\0';
+                        int id = atoi(num_);
+                        free(num_);
 
-            char* digits = malloc(11);
-            if (!digits){
-                printf("Failed memory allocation to load model.\n");
-                return 1;
-            }
-            strcpy(digits, "0123456789");
+                        if (!id_to_token(id)){
+                            printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
+                            return 1;
+                        }
 
-            for (int index = 0; index < embeddings_raw_size; index++){
-                if (!cJSON_IsArray(curr_embedding_raw_item)){
-                    printf("Model file is corrupted.\n");
-                    return 1;
+                        loadFloats(curr_embedding_raw_item, embedding_row(id), embeddingSize);
+                        curr_embedding_raw_item = curr_embedding_raw_item->next;
+                    }
                 }
-                //get id from filename
-                //we will hope id is consistent and the first number in the str of the filename.
-                if (!cJSON_IsString(cJSON_GetArrayItem(curr_embedding_raw_item, 0))){
+
+                cJSON* vocab_projection_raw = cJSON_GetObjectItem(transformer_structure, "vocab_projection");
+                if (!cJSON_IsObject(vocab_projection_raw)){
                     printf("Model file is corrupted.\n");
                     return 1;
                 }
-                int curr_embedding_raw_item_filename_len = strlen(cJSON_GetArrayItem(curr_embedding_raw_item, 0)->valuestring);
-                if (curr_embedding_raw_item_filename_len == 0){
+                cJSON* vocab_projection_raw_weights = cJSON_GetObjectItem(vocab_projection_raw, "weights");
+                cJSON* vocab_projection_raw_biases = cJSON_GetObjectItem(vocab_projection_raw, "biases");
+                if (!cJSON_IsArray(vocab_projection_raw_weights)){
                     printf("Model file is corrupted.\n");
                     return 1;
                 }
-                char* num_ = malloc(32);
-                bool foundid = false;
-                
-                if (!num_){
-                    printf("Failed to allocate memory to load model.\n");
-                    return 1;
-                }
-                int cursor_ = 0;
-                for (int subindex = 0; subindex < curr_embedding_raw_item_filename_len; subindex++){
-                    char currchr = cJSON_GetArrayItem(curr_embedding_raw_item, 0)->valuestring[subindex];
-                    bool isdigit = false;
-                    for (int subsubindex = 0; subsubindex < 10; subsubindex++){
-                        if (digits[subsubindex] == currchr){
-                            isdigit = true;
-                            foundid = true;
-                            break;
-                        }
-                    }
-                    if (!isdigit){
-                        if (foundid){
-                            break;
-                        }
-                    }
-                    else{
-                        if (cursor_ < 31){
-                            num_[cursor_] = currchr;
-                            cursor_++;
-                        }
-                    }
-                }
-                if (!foundid){
+                if (!cJSON_IsArray(vocab_projection_raw_biases)){
                     printf("Model file is corrupted.\n");
                     return 1;
                 }
-                num_[cursor_] = '\0';
-                int id = atoi(num_);
-                free(num_);
-
-                if (!id_to_token(id)){
-                    printf("The model you are trying to load doesn't use the same vocabulary as yours.\n");
-                    return 1;
-                }
-
-                embeddings[id] = loadFloats(curr_embedding_raw_item, mname("embeddings[%d]", id));
-                curr_embedding_raw_item = curr_embedding_raw_item->next;
-            }
-
-            cJSON* vocab_projection_raw = cJSON_GetObjectItem(transformer_structure, "vocab_projection");
-            if (!cJSON_IsObject(vocab_projection_raw)){
-                printf("Model file is corrupted.\n");
-                return 1;
-            }
-            cJSON* vocab_projection_raw_weights = cJSON_GetObjectItem(vocab_projection_raw, "weights");
-            cJSON* vocab_projection_raw_biases = cJSON_GetObjectItem(vocab_projection_raw, "biases");
-            if (!cJSON_IsArray(vocab_projection_raw_weights)){
-                printf("Model file is corrupted.\n");
-                return 1;
-            }
-            if (!cJSON_IsArray(vocab_projection_raw_biases)){
-                printf("Model file is corrupted.\n");
-                return 1;
+                loadFloats(vocab_projection_raw_weights, vocab_projection.weights, vocab_len * embeddingSize);
+                loadFloats(vocab_projection_raw_biases, vocab_projection.biases, vocab_len);
             }
-            vocab_projection.weights = loadFloats(vocab_projection_raw_weights, mname("vocab_projection.weights"));
-            vocab_projection.biases = loadFloats(vocab_projection_raw_biases, mname("vocab_projection.biases"));
 
             for (int index = 0; index < n_files; index++){
                 if (files[index][0]){
@@ -2705,32 +5802,100 @@ int main(int argc, char** argv){
             }
             free(files);
             free(files_len);
+            free(files_pending);
+            free(files_index);
+            mz_zip_reader_end(&zipfile);
+            if (keep_checkpoint_reference && planar_checkpoint && (model_planes == 3)){
+                set_xor_reference(model_location, delta_base ? delta_depth : xor_depth, arena, false);
+                //Walk the whole chain, loading may not have needed every checkpoint in it but saving must not overwrite any.
+                char* ancestor = xor_base ? xor_base : delta_base;
+                for (int depth = 0; ancestor && xor_reference && (depth < 1024); depth++){
+                    add_reference_ancestor(ancestor);
+                    base_checkpoint* base = open_base(ancestor);
+                    ancestor = base ? (base->xor_base ? base->xor_base : base->delta_base) : NULL;
+                }
+            }
+            for (int index = 0; index < bases_len; index++){
+                mz_zip_reader_end(&bases[index]->zip);
+                cJSON_Delete(bases[index]->meta);
+                free(bases[index]->xor_base);
+                free(bases[index]->delta_base);
+                free(bases[index]->path);
+                free(bases[index]);
+            }
+            free(bases);
+            free(xor_base);
+            free(delta_base);
             printf("Loaded model in %lldms.\n", timer_end(timer_));
+            if (!publish_manifest()){
+                return 1;
+            }
+        }
+        else{
+            if (attach){
+                printf("Attaching to model \"%s\"...\n", model_id);
+                long long timer_ = timer();
+                if (!attach_model()){
+                    return 1;
+                }
+                printf("Attached to model \"%s\" in %lldms.\n", model_id, timer_end(timer_));
+            }
+            else{
+                if (native_load){
+                    printf("Mapping model file (\"%s\").\n", model_location);
+                    long long timer_ = timer();
+                    if (!load_native_checkpoint(model_location, do_train || do_pretrain)){
+                        return 1;
+                    }
+                    if ((model_planes == 1) && (do_train || do_pretrain)){
+                        printf("This model was exported for inference only, it has no adam moments to train with.\n");
+                        return 1;
+                    }
+                    printf("Mapped model in %lldms.\n", timer_end(timer_));
+                }
+            }
         }
     }
 
-    float** calculate_positional_encoding(int sequence_length){
-        float** positional_encodings = malloc(sequence_length * sizeof(float*));
-        if (!positional_encodings){
-            printf("Failed to allocate memory to calculate positional encodings.\n");
-            exit(1);
+    select_kernels();
+    printf("Using %s vector kernels.\n", kernel_name);
+
+    //Roughly one layer's worth of activations for a full context, the workspace grows by itself if that's not enough.
+    ws_reserve((size_t)(contextSize) * (embeddingSize * 12 + heads * contextSize) * sizeof(float));
+
+    //Fills out ([sequence_length x embeddingSize]) with sinusoidal positional encodings.
+    float* calculate_positional_encoding_into(float* out, int sequence_length){
+        if (!out){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
         }
         for (int index = 0; index < sequence_length; index++){
-            positional_encodings[index] = malloc(embeddingSize * sizeof(float));
-            if (!positional_encodings[index]){
-                printf("Failed to allocate memory to calculate positional encodings.\n");
-                exit(1);
-            }
+            float* row = out + (size_t)(index) * embeddingSize;
             for (int subindex = 0; subindex < embeddingSize; subindex++){
                 float denominator = powf(10000.0f, (2.0f * floorf(subindex / 2.0f)) / (float)(embeddingSize));
                 if (subindex % 2 == 0){
-                    positional_encodings[index][subindex] = sinf(index / denominator);
+                    row[subindex] = sinf(index / denominator);
                 }
                 else{
-                    positional_encodings[index][subindex] = cosf(index / denominator);
+                    row[subindex] = cosf(index / denominator);
                 }
             }
         }
+        return out;
+    }
+
+    //Caller frees positional_encodings[0] then positional_encodings.
+    float** calculate_positional_encoding(int sequence_length){
+        float** positional_encodings = malloc(sequence_length * sizeof(float*));
+        float* data = malloc((size_t)(sequence_length) * embeddingSize * sizeof(float));
+        if (!positional_encodings || !data){
+            printf("Failed to allocate memory to calculate positional encodings.\n");
+            exit(1);
+        }
+        calculate_positional_encoding_into(data, sequence_length);
+        for (int index = 0; index < sequence_length; index++){
+            positional_encodings[index] = data + (size_t)(index) * embeddingSize;
+        }
         return positional_encodings;
     }
 
@@ -2738,10 +5903,37 @@ int main(int argc, char** argv){
         if (!id_to_token(id)){
             return NULL; //Invalid token.
         }
-        return embeddings[id];
+        return embedding_row(id);
     }
 
-    float* _calculate_x_hat_only(float* in, int in_len){
+    //Gathers the embeddings of a whole sequence into out ([ids_len x embeddingSize], values only).
+    bool get_embeddings(int* ids, int ids_len, float* out){
+        if (!ids){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return false;
+        }
+        if (!out){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return false;
+        }
+        for (int index = 0; index < ids_len; index++){
+            if (!id_to_token(ids[index])){
+                return false; //Invalid token.
+            }
+            memcpy(out + (size_t)(index) * embeddingSize, embedding_row(ids[index]), embeddingSize * sizeof(float));
+        }
+        return true;
+    }
+
+    //The vector primitives below take a stride in floats between consecutive elements of the activation vectors
+    //(dst/vec/in), so they can walk a column or every n-th element in place. Parameters (g, b) are always unit stride.
+    //dst may be the same as the input, which is how the in-place forms work.
+
+    float* _calculate_x_hat_only_into(float* x_hat, float* in, int in_len, int stride){
+        if (!x_hat){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
         if (!in){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return NULL;
@@ -2749,34 +5941,50 @@ int main(int argc, char** argv){
         if (in_len < 1){
             return NULL;
         }
+        if (stride < 1){
+            return NULL;
+        }
         float mean = 0;
         for (int index = 0; index < in_len; index++){
-            mean += in[index];
+            mean += in[(size_t)(index) * stride];
         }
         mean = mean / in_len;
 
         float varience = 0;
         for (int index = 0; index < in_len; index++){
-            varience += (in[index] - mean) * (in[index] - mean);
+            float d = in[(size_t)(index) * stride] - mean;
+            varience += d * d;
         }
         varience = varience / in_len;
 
         float epsilon = 1e-8;
         float std = sqrtf(varience + epsilon);
         
-        float* x_hat = malloc(in_len * sizeof(float));
-        if (!x_hat){
-            printf("Failed memory allocation to calculate x hat.\n");
-            exit(1);
-        }
         for (int index = 0; index < in_len; index++){
-            x_hat[index] = (in[index] - mean) / std;
+            x_hat[(size_t)(index) * stride] = (in[(size_t)(index) * stride] - mean) / std;
         }
 
         return x_hat;
     }
 
-    float* normalize_vector(float* vec, int vec_len, float* g, float* b){
+    //Caller frees the result.
+    float* _calculate_x_hat_only(float* in, int in_len){
+        if (in_len < 1){
+            return NULL;
+        }
+        float* out = malloc(in_len * sizeof(float));
+        if (!out){
+            printf("Failed memory allocation to calculate x hat.\n");
+            exit(1);
+        }
+        return _calculate_x_hat_only_into(out, in, in_len, 1);
+    }
+
+    float* normalize_vector_into(float* dst, float* vec, int vec_len, float* g, float* b, int stride){
+        if (!dst){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
         if (!vec){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return NULL; //deref null is crazy work bro
@@ -2792,20 +6000,77 @@ int main(int argc, char** argv){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return NULL;
         }
-        float* x_hat = _calculate_x_hat_only(vec, vec_len);
-        if (!x_hat){
-            printf("Failed to calculate x_hat.\n"); //In case physics have broken down or a bitflip or idk
-            exit(1);
+        if (stride < 1){
+            return NULL;
+        }
+        if (stride == 1){
+            layernorm_kernel(dst, vec, g, b, vec_len);
+            return dst;
         }
+        //Same two passes as layernorm_f32_scalar(), walking the stride.
+        float shift = vec[0];
+        float sum = 0;
+        float sumsq = 0;
+        for (int index = 0; index < vec_len; index++){
+            float d = vec[(size_t)(index) * stride] - shift;
+            sum += d;
+            sumsq += d * d;
+        }
+        float mean;
+        float rstd;
+        layernorm_stats(sum, sumsq, shift, vec_len, &mean, &rstd);
         for (int index = 0; index < vec_len; index++){
-            x_hat[index] = x_hat[index] * g[index * 3] + b[index * 3];
+            size_t at = (size_t)(index) * stride;
+            dst[at] = (vec[at] - mean) * rstd * g[index] + b[index];
         }
+        return dst;
+    }
 
-        return x_hat;
+    //Normalizes every row of in ([rows x vec_len], e.g. a whole sequence) into dst with the same g and b.
+    float* normalize_rows_into(float* dst, float* in, int rows, int vec_len, float* g, float* b){
+        if (!dst){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!in){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!g){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!b){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (vec_len < 1){
+            return NULL;
+        }
+        for (int index = 0; index < rows; index++){
+            layernorm_kernel(dst + (size_t)(index) * vec_len, in + (size_t)(index) * vec_len, g, b, vec_len);
+        }
+        return dst;
+    }
+
+    float* normalize_vector_inplace(float* vec, int vec_len, float* g, float* b, int stride){
+        return normalize_vector_into(vec, vec, vec_len, g, b, stride);
+    }
+
+    //Caller frees the result.
+    float* normalize_vector(float* vec, int vec_len, float* g, float* b){
+        if (vec_len < 1){
+            return NULL;
+        }
+        float* out = malloc(vec_len * sizeof(float));
+        if (!out){
+            printf("Failed memory allocation to normalize vector.\n");
+            exit(1);
+        }
+        return normalize_vector_into(out, vec, vec_len, g, b, 1);
     }
 
     float dot_product(float* vec1, int vec1_len, float* vec2, int vec2_len){
-        float sum = 0;
         if (vec1_len != vec2_len){
             return -1; //Bro what the fuck
         }
@@ -2820,84 +6085,274 @@ int main(int argc, char** argv){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return -1;
         }
-        for (int index = 0; index < vec1_len; index++){
-            sum += vec1[index] * vec2[index];
+        return dot_kernel(vec1, vec2, vec1_len);
+    }
+
+    //Same as dot_product but each vector has its own stride, e.g. a row against a column of a row major matrix.
+    float dot_product_strided(float* vec1, int stride1, float* vec2, int stride2, int len){
+        float sum = 0;
+        if (len < 1){
+            return -1;
+        }
+        if (stride1 < 1 || stride2 < 1){
+            return -1;
+        }
+        if (!vec1){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return -1;
+        }
+        if (!vec2){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return -1;
+        }
+        if (stride1 == 1 && stride2 == 1){
+            return dot_kernel(vec1, vec2, len);
+        }
+        for (int index = 0; index < len; index++){
+            sum += vec1[(size_t)(index) * stride1] * vec2[(size_t)(index) * stride2];
         }
         return sum;
     }
 
-    float* add_vectors(float* vec1, int vec1_len, float* vec2, int vec2_len){
+    //Writes the dot product of every row of mat ([rows x len], rows row_stride floats apart) with vec to dst[row * stride].
+    float* dot_product_into(float* dst, float* mat, int rows, int row_stride, float* vec, int len, int stride){
+        if (!dst){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!mat){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        for (int index = 0; index < rows; index++){
+            dst[(size_t)(index) * stride] = dot_product_strided(mat + (size_t)(index) * row_stride, 1, vec, 1, len);
+        }
+        return dst;
+    }
+
+    //Projects every row of in ([rows x in_len], e.g. a whole sequence) through weights laid out like the model's,
+    //[out_len x in_len] with one row per output, into dst ([rows x out_len]). bias can be NULL.
+    float* project_rows_into(float* dst, float* in, int rows, int in_len, float* weights, float* bias, int out_len){
+        if (!dst){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!in){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!weights){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (in_len < 1 || out_len < 1){
+            return NULL;
+        }
+        if (rows == 1){
+            sgemv(dst, weights, in_len, in, bias, out_len, in_len);
+            return dst;
+        }
+        sgemm(false, true, rows, out_len, in_len, in, in_len, weights, in_len, bias, dst, out_len, false);
+        return dst;
+    }
+
+    float* add_vectors_into(float* dst, float* vec1, int vec1_len, float* vec2, int vec2_len, int stride){
+        if (!dst){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
         if (vec1_len != vec2_len){
             return NULL;
         }
         if (vec1_len < 1){
             return NULL;
         }
-        if (!vec1){
+        if (!vec1){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!vec2){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+
+        if (stride < 1){
+            return NULL;
+        }
+
+        if (stride == 1){
+            add_kernel(dst, vec1, vec2, vec1_len);
+            return dst;
+        }
+        for (int index = 0; index < vec1_len; index++){
+            size_t at = (size_t)(index) * stride;
+            dst[at] = vec1[at] + vec2[at];
+        }
+
+        return dst;
+    }
+
+    //vec1 += vec2, e.g. a residual connection.
+    float* add_vectors_inplace(float* vec1, float* vec2, int len, int stride){
+        return add_vectors_into(vec1, vec1, len, vec2, len, stride);
+    }
+
+    //Caller frees the result.
+    float* add_vectors(float* vec1, int vec1_len, float* vec2, int vec2_len){
+        if (vec1_len < 1){
+            return NULL;
+        }
+        float* out = malloc(vec1_len * sizeof(float));
+        if (!out){
+            printf("Failed memory allocation to add vectors.\n");
+            exit(1);
+        }
+        return add_vectors_into(out, vec1, vec1_len, vec2, vec2_len, 1);
+    }
+
+    float* softmax_into(float* rets, float* vec, int vec_len, int stride){
+        if (!rets){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (!vec){
+            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
+            return NULL;
+        }
+        if (vec_len < 1){
+            return NULL;
+        }
+        if (stride < 1){
+            return NULL;
+        }
+        
+        if (stride == 1){
+            softmax_kernel(rets, vec, vec_len, softmax_fast_exp);
+            return rets;
+        }
+
+        float max = -__FLT_MAX__;
+        for (int index = 0; index < vec_len; index++){
+            if (vec[(size_t)(index) * stride] > max){
+                max = vec[(size_t)(index) * stride];
+            }
+        }
+        
+        float exp_sum = 0;
+        for (int index = 0; index < vec_len; index++){
+            rets[(size_t)(index) * stride] = exp_f32(vec[(size_t)(index) * stride] - max, softmax_fast_exp);
+            exp_sum += rets[(size_t)(index) * stride];
+        }
+        if (exp_sum == 0){
+            for (int index = 0; index < vec_len; index++){
+                rets[(size_t)(index) * stride] = 1.0f / (float)(vec_len);
+            }
+            return rets;
+        }
+        float scale = 1.0f / exp_sum;
+        for (int index = 0; index < vec_len; index++){
+            rets[(size_t)(index) * stride] *= scale;
+        }
+        return rets;
+    }
+
+    //Softmax of every row of a rows x cols matrix, dst may be in. With causal, row i only covers the first
+    //cols - rows + i + 1 columns (the last rows tokens attending to everything before them), the rest is zeroed.
+    float* softmax_rows_into(float* dst, float* in, int rows, int cols, bool causal){
+        if (!dst){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return NULL;
         }
-        if (!vec2){
+        if (!in){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return NULL;
         }
-
-        float* new_vec = malloc(vec1_len * sizeof(float));
-        if (!new_vec){
-            printf("Failed memory allocation to add vectors.\n");
-            exit(1);
+        if (cols < 1){
+            return NULL;
         }
-        
-        for (int index = 0; index < vec1_len; index++){
-            new_vec[index] = vec1[index] + vec2[index];
+        if (causal && rows > cols){
+            return NULL;
+        }
+        for (int index = 0; index < rows; index++){
+            float* row_out = dst + (size_t)(index) * cols;
+            int visible = causal ? cols - rows + index + 1 : cols;
+            softmax_kernel(row_out, in + (size_t)(index) * cols, visible, softmax_fast_exp);
+            if (visible < cols){
+                memset(row_out + visible, 0, (size_t)(cols - visible) * sizeof(float));
+            }
         }
+        return dst;
+    }
 
-        return new_vec;
+    float* softmax_inplace(float* vec, int vec_len, int stride){
+        return softmax_into(vec, vec, vec_len, stride);
     }
 
+    //Caller frees the result.
     float* softmax(float* vec, int vec_len){
-        if (!vec){
-            printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
-            return NULL;
-        }
         if (vec_len < 1){
             return NULL;
         }
-        
-        float max = -__FLT_MAX__;
-        for (int index = 0; index < vec_len; index++){
-            if (vec[index] > max){
-                max = vec[index];
-            }
-        }
-        
-        float* rets = malloc(vec_len * sizeof(float));
-        if (!rets){
+        float* out = malloc(vec_len * sizeof(float));
+        if (!out){
             printf("Failed memory allocation to do softmax.\n");
             exit(1);
         }
-        
-        for (int index = 0; index < vec_len; index++){
-            rets[index] = expf(vec[index] - max);
+        return softmax_into(out, vec, vec_len, 1);
+    }
+    
+    //Writes the arena as is behind a manifest, see load_native_checkpoint(). The values plane comes first so values only is just a shorter write.
+    bool save_native(char* filepath, bool values_only){
+        int planes = values_only ? 1 : model_planes;
+        size_t data_offset = native_data_offset(tensor_table_len);
+        char* head = calloc(data_offset, 1);
+        if (!head){
+            printf("Failed to allocate memory to save model.\n");
+            return false;
         }
+        fill_manifest((manifest_header*)head, NATIVE_MAGIC, planes);
 
-        long double exp_sum = 0;
-        for (int index = 0; index < vec_len; index++){
-            exp_sum += rets[index];
+        //The arena may be a copy on write view of filepath itself (see load_native_checkpoint()), truncating it
+        //in place would pull the pages out from under us. Write next to it and swap it in once it's all on disk.
+        char* tmp_path = malloc(strlen(filepath) + 5);
+        if (!tmp_path){
+            free(head);
+            return false;
         }
-        if (exp_sum == 0){
-            for (int index = 0; index < vec_len; index++){
-                rets[index] = 1.0f / (float)(vec_len);
-            }
-            return rets;
+        sprintf(tmp_path, "%s.tmp", filepath);
+        FILE* file = fopen(tmp_path, "wb");
+        if (!file){
+            free(head);
+            free(tmp_path);
+            return false;
         }
-        for (int index = 0; index < vec_len; index++){
-            rets[index] = rets[index] / (float)(exp_sum);
+        bool ok = (fwrite(head, 1, data_offset, file) == data_offset) && (fwrite(arena, 1, plane_size * planes, file) == plane_size * planes) && sync_file(file);
+        free(head);
+        if (fclose(file) != 0){
+            ok = false;
         }
-        return rets;
+        if (ok){
+            ok = replace_file(tmp_path, filepath);
+        }
+        if (!ok){
+            remove(tmp_path);
+        }
+        free(tmp_path);
+        return ok;
     }
-    
-    bool save(char* filepath){
+
+    //Filters only pay off when compressing. Never XOR against a chain containing the file about to be replaced, it couldn't be undone.
+    bool xor_against_reference(char* filepath, bool values_only){
+        return (checkpoint_xor > 0) && (!values_only) && xor_reference && (xor_reference_depth < checkpoint_xor) && (checkpoint_level != MZ_NO_COMPRESSION) && (!in_reference_chain(filepath));
+    }
+
+    //Leave out whatever didn't change since the reference. The base files are needed to load the result, so never when the file about to be replaced is one of them either.
+    bool delta_against_reference(char* filepath, bool values_only){
+        return (checkpoint_delta > 0) && (!values_only) && xor_reference && (xor_reference_depth < checkpoint_delta) && (!in_reference_chain(filepath));
+    }
+
+    //values_only leaves the adam moments out, for models that will only be used for inference.
+    bool save(char* filepath, bool values_only){
         if (!filepath){
             printf("Null dereference caught from: %p.\n", __builtin_return_address(0));
             return false;
@@ -2906,239 +6361,346 @@ int main(int argc, char** argv){
         printf("Saving model at path \"%s\"...\n", filepath);
         long long save_timer = timer();
 
-        //I tought the following function existed but it didn't, let's satisfy the code.
-        void cJSON_AddNumberToArray(cJSON* arr, float n){
-            cJSON_AddItemToArray(arr, cJSON_CreateNumber(n));
-            return;
-        }
-
-        cJSON* model_meta_root = cJSON_CreateObject();
-        
-        cJSON_AddNumberToObject(model_meta_root, "contextSize", contextSize);
-        cJSON_AddNumberToObject(model_meta_root, "embeddingSize", embeddingSize);
-        cJSON_AddNumberToObject(model_meta_root, "learningRate", learningRate);
-        cJSON_AddNumberToObject(model_meta_root, "maxOutputSize", maxOutputSize);
-        cJSON_AddNumberToObject(model_meta_root, "layersAmount", layersAmount);
-        cJSON_AddNumberToObject(model_meta_root, "heads", heads);
-        
-        cJSON* biasesinitrange_save = cJSON_CreateArray();
-        cJSON_AddNumberToArray(biasesinitrange_save, biasesinitrange[0]);
-        cJSON_AddNumberToArray(biasesinitrange_save, biasesinitrange[1]);
-        cJSON_AddItemToObject(model_meta_root, "biasesinitrange", biasesinitrange_save);
-
-        cJSON* embeddinginitrange_save = cJSON_CreateArray();
-        cJSON_AddNumberToArray(embeddinginitrange_save, embeddinginitrange[0]);
-        cJSON_AddNumberToArray(embeddinginitrange_save, embeddinginitrange[1]);
-        cJSON_AddItemToObject(model_meta_root, "embeddinginitrange", embeddinginitrange_save);
-
-        cJSON* adam_params_save = cJSON_CreateObject();
-        cJSON_AddNumberToObject(adam_params_save, "beta1", adam_params.beta1);
-        cJSON_AddNumberToObject(adam_params_save, "beta2", adam_params.beta2);
-        cJSON_AddNumberToObject(adam_params_save, "epsilon", adam_params.epsilon);
-        cJSON_AddNumberToObject(adam_params_save, "t", adam_params.t);
-        cJSON_AddItemToObject(model_meta_root, "adam_params", adam_params_save);
-
-        cJSON_AddNumberToObject(model_meta_root, "step_num", step_num);
-
-        cJSON* transformer_structure_save = cJSON_CreateObject();
-        cJSON* layers_save = cJSON_CreateArray();
-
-        for (int index = 0; index < layersAmount; index++){
-            cJSON* layer_curr_save = cJSON_CreateObject();
-            cJSON* weights_save = cJSON_CreateObject();
-
-            cJSON* normalize_1_save = cJSON_CreateArray();
-            char num1[32];
-            itoa(index, num1, 10);
-            char norm_spath[strlen("layers[].weights.normalize_1") + strlen(num1) + 1];
-            sprintf(norm_spath, "layers[%s].weights.normalize_1", num1);
-            cJSON_AddItemToArray(normalize_1_save, cJSON_CreateString(norm_spath));
-            cJSON_AddItemToObject(weights_save, "normalize_1", normalize_1_save);
-
-            cJSON* normalize_2_save = cJSON_CreateArray();
-            sprintf(norm_spath, "layers[%s].weights.normalize_2", num1);
-            cJSON_AddItemToArray(normalize_2_save, cJSON_CreateString(norm_spath));
-            cJSON_AddItemToObject(weights_save, "normalize_2", normalize_2_save);
-
-            cJSON* attention_save = cJSON_CreateObject();
-            cJSON* heads_save = cJSON_CreateArray();
-            for (int subindex = 0; subindex < heads; subindex++){
-                cJSON* heads_save_curr = cJSON_CreateObject();
-                
-                cJSON* query_curr = cJSON_CreateArray();
-                char num2[32];
-                itoa(subindex, num2, 10);
-                char query_spath[strlen(num2) + strlen("layers[].weights.attention.heads[].query") + strlen(num1) + 1];
-                sprintf(query_spath, "layers[%s].weights.attention.heads[%s].query", num1, num2);
-                cJSON_AddItemToArray(query_curr, cJSON_CreateString(query_spath));
-                cJSON_AddItemToObject(heads_save_curr, "query", query_curr);
-
-                cJSON* key_curr = cJSON_CreateArray();
-                sprintf(query_spath, "layers[%s].weights.attention.heads[%s].key", num1, num2);
-                cJSON_AddItemToArray(key_curr, cJSON_CreateString(query_spath));
-                cJSON_AddItemToObject(heads_save_curr, "key", key_curr);
-
-                cJSON* value_curr = cJSON_CreateArray();
-                sprintf(query_spath, "layers[%s].weights.attention.heads[%s].value", num1, num2);
-                cJSON_AddItemToArray(value_curr, cJSON_CreateString(query_spath));
-                cJSON_AddItemToObject(heads_save_curr, "value", value_curr);
+        values_only = values_only || (model_planes == 1);
 
-                cJSON_AddItemToArray(heads_save, heads_save_curr);
+        if (native_checkpoints){
+            if (!save_native(filepath, values_only)){
+                printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+                return false;
             }
+            printf("Saved model at path \"%s\" in %lldms.\n", filepath, timer_end(save_timer));
+            return true;
+        }
 
-            cJSON_AddItemToObject(attention_save, "heads", heads_save);
-
-            cJSON* output_save = cJSON_CreateArray();
-            char output_curr_spath[strlen(num1) + strlen("layers[].weights.attention.output") + 1];
-            sprintf(output_curr_spath, "layers[%s].weights.attention.output", num1);
-            cJSON_AddItemToArray(output_save, cJSON_CreateString(output_curr_spath));
-            cJSON_AddItemToObject(attention_save, "output", output_save);
-
-            cJSON_AddItemToObject(weights_save, "attention", attention_save);
-
-            cJSON* ffw_save = cJSON_CreateObject();
-            cJSON* ffw_save_grow = cJSON_CreateArray();
-            cJSON* ffw_save_shrink = cJSON_CreateArray();
-            
-            char ffw_spaths[strlen(num1) + strlen("layers[].weights.feed_forward.shrink") + 1];
-            sprintf(ffw_spaths, "layers[%s].weights.feed_forward.grow", num1);
-            cJSON_AddItemToArray(ffw_save_grow, cJSON_CreateString(ffw_spaths));
-
-            sprintf(ffw_spaths, "layers[%s].weights.feed_forward.shrink", num1);
-            cJSON_AddItemToArray(ffw_save_shrink, cJSON_CreateString(ffw_spaths));
-
-            cJSON_AddItemToObject(ffw_save, "grow", ffw_save_grow);
-            cJSON_AddItemToObject(ffw_save, "shrink", ffw_save_shrink);
-
-            cJSON_AddItemToObject(weights_save, "feed_forward", ffw_save);
-            
-            cJSON_AddItemToObject(layer_curr_save, "weights", weights_save);
-
-
-            cJSON* biases_save = cJSON_CreateObject();
-
-            cJSON* normalize_1_biases = cJSON_CreateArray();
-            char norm1_bpath[strlen("layers[].biases.normalize_1") + strlen(num1) + 1];
-            sprintf(norm1_bpath, "layers[%s].biases.normalize_1", num1);
-            cJSON_AddItemToArray(normalize_1_biases, cJSON_CreateString(norm1_bpath));
-            cJSON_AddItemToObject(biases_save, "normalize_1", normalize_1_biases);
-
-            cJSON* normalize_2_biases = cJSON_CreateArray();
-            sprintf(norm1_bpath, "layers[%s].biases.normalize_2", num1);
-            cJSON_AddItemToArray(normalize_2_biases, cJSON_CreateString(norm1_bpath));
-            cJSON_AddItemToObject(biases_save, "normalize_2", normalize_2_biases);
-
-            cJSON* attention_biases = cJSON_CreateObject();
-            cJSON* heads_biases = cJSON_CreateArray();
-            for (int subindex = 0; subindex < heads; subindex++){
-                cJSON* heads_biases_curr = cJSON_CreateObject();
-
-                char num2[32];
-                itoa(subindex, num2, 10);
-
-                cJSON* query_bias = cJSON_CreateArray();
-                char query_bpath[strlen(num2) + strlen("layers[].biases.attention.heads[].query") + strlen(num1) + 1];
-                sprintf(query_bpath, "layers[%s].biases.attention.heads[%s].query", num1, num2);
-                cJSON_AddItemToArray(query_bias, cJSON_CreateString(query_bpath));
-                cJSON_AddItemToObject(heads_biases_curr, "query", query_bias);
-
-                cJSON* key_bias = cJSON_CreateArray();
-                sprintf(query_bpath, "layers[%s].biases.attention.heads[%s].key", num1, num2);
-                cJSON_AddItemToArray(key_bias, cJSON_CreateString(query_bpath));
-                cJSON_AddItemToObject(heads_biases_curr, "key", key_bias);
-
-                cJSON* value_bias = cJSON_CreateArray();
-                sprintf(query_bpath, "layers[%s].biases.attention.heads[%s].value", num1, num2);
-                cJSON_AddItemToArray(value_bias, cJSON_CreateString(query_bpath));
-                cJSON_AddItemToObject(heads_biases_curr, "value", value_bias);
-
-                cJSON_AddItemToArray(heads_biases, heads_biases_curr);
+        bool use_shuffle = checkpoint_shuffle && (checkpoint_level != MZ_NO_COMPRESSION);
+        bool use_xor = xor_against_reference(filepath, values_only);
+        bool use_delta = delta_against_reference(filepath, values_only);
+
+        //tensors.idx lists every tensor, the ones a delta checkpoint leaves out too.
+        out_buffer index_file = {0};
+        tensor_index_header index_header;
+        memcpy(index_header.magic, TENSOR_INDEX_MAGIC, 8);
+        index_header.count = 0;
+        index_header.layout_hash = layout_hash();
+        index_header.plane_size = plane_size;
+        void index_tensor(const char* path, float* tensor, size_t count){
+            if (index_file.len == 0){
+                buf_append(&index_file, &index_header, sizeof index_header); //count is filled in once everything is queued
+            }
+            uint64_t offset = (char*)(tensor) - arena;
+            uint64_t count_ = count;
+            uint16_t name_len = strlen(path);
+            buf_append(&index_file, &offset, sizeof offset);
+            buf_append(&index_file, &count_, sizeof count_);
+            buf_append(&index_file, &name_len, sizeof name_len);
+            buf_append(&index_file, path, name_len);
+            index_header.count++;
+        }
+
+        //Whether count floats at part differ from the same spot in the reference.
+        bool changed_since_reference(const float* part, size_t count){
+            return memcmp(part, xor_reference + ((const char*)(part) - arena), count * sizeof(float)) != 0;
+        }
+
+        //Tensors are written as their value, m and v blocks back to back, by write_tensors() once they're all queued.
+        deflate_job* jobs = NULL;
+        int jobs_len = 0;
+        int jobs_cap = 0;
+        int tensors_written = 0;
+        deflate_job* add_job(const char* path){
+            if (jobs_len == jobs_cap){
+                int cap = jobs_cap ? jobs_cap * 2 : 256;
+                deflate_job* tmp = realloc(jobs, cap * sizeof(deflate_job));
+                if (!tmp){
+                    printf("Failed to allocate memory to save model.\n");
+                    return NULL;
+                }
+                jobs = tmp;
+                jobs_cap = cap;
             }
-            cJSON_AddItemToObject(attention_biases, "heads", heads_biases);
-
-            cJSON* output_bias = cJSON_CreateArray();
-            char output_bpath[strlen(num1) + strlen("layers[].biases.attention.output") + 1];
-            sprintf(output_bpath, "layers[%s].biases.attention.output", num1);
-            cJSON_AddItemToArray(output_bias, cJSON_CreateString(output_bpath));
-            cJSON_AddItemToObject(attention_biases, "output", output_bias);
-
-            cJSON_AddItemToObject(biases_save, "attention", attention_biases);
-
-            cJSON* ffw_biases = cJSON_CreateObject();
-            cJSON* ffw_bias_grow = cJSON_CreateArray();
-            cJSON* ffw_bias_shrink = cJSON_CreateArray();
-
-            char ffw_bpaths[strlen(num1) + strlen("layers[].biases.feed_forward.shrink") + 1];
-            sprintf(ffw_bpaths, "layers[%s].biases.feed_forward.grow", num1);
-            cJSON_AddItemToArray(ffw_bias_grow, cJSON_CreateString(ffw_bpaths));
-
-            sprintf(ffw_bpaths, "layers[%s].biases.feed_forward.shrink", num1);
-            cJSON_AddItemToArray(ffw_bias_shrink, cJSON_CreateString(ffw_bpaths));
-
-            cJSON_AddItemToObject(ffw_biases, "grow", ffw_bias_grow);
-            cJSON_AddItemToObject(ffw_biases, "shrink", ffw_bias_shrink);
-
-            cJSON_AddItemToObject(biases_save, "feed_forward", ffw_biases);
-
-            cJSON_AddItemToObject(layer_curr_save, "biases", biases_save);
-
-            cJSON_AddItemToArray(layers_save, layer_curr_save);
+            deflate_job* job = &jobs[jobs_len];
+            memset(job, 0, sizeof(deflate_job));
+            job->path = malloc(strlen(path) + 1);
+            if (!job->path){
+                printf("Failed to allocate memory to save model.\n");
+                return NULL;
+            }
+            strcpy(job->path, path);
+            jobs_len++;
+            return job;
         }
 
-        cJSON_AddItemToObject(transformer_structure_save, "layers", layers_save);
-        
-        cJSON* embeddings_save = cJSON_CreateArray();
-
-        for (int index = 0; index < vocab_len + gap_size; index++){
-            if (!embeddings[index]){
-                continue;
+        bool queue_tensor(char* path, float* tensor, size_t count){
+            index_tensor(path, tensor, count);
+            if (use_delta && (!changed_since_reference(tensor, count)) && (!changed_since_reference(adam_m(tensor), count)) && (!changed_since_reference(adam_v(tensor), count))){
+                return true;
             }
-            cJSON* embedding_curr_save = cJSON_CreateArray();
-            char num__[32];
-            itoa(index, num__, 10);
-            char spath_curr[strlen(num__) + strlen("embeddings[]") + 1];
-            sprintf(spath_curr, "embeddings[%s]", num__);
-
-            cJSON_AddItemToArray(embedding_curr_save, cJSON_CreateString(spath_curr));
-            cJSON_AddItemToArray(embeddings_save, embedding_curr_save);
+            deflate_job* job = add_job(path);
+            if (!job){
+                return false;
+            }
+            job->planes = values_only ? 1 : 3;
+            job->parts[0] = tensor;
+            if (!values_only){
+                job->parts[1] = adam_m(tensor);
+                job->parts[2] = adam_v(tensor);
+            }
+            job->part_size = count * sizeof(float);
+            job->shuffle = use_shuffle;
+            if (use_xor){
+                for (int plane = 0; plane < 3; plane++){
+                    job->refs[plane] = xor_reference + ((const char*)(job->parts[plane]) - arena);
+                }
+            }
+            tensors_written++;
+            return true;
         }
 
-        cJSON_AddItemToObject(transformer_structure_save, "embeddings", embeddings_save);
-
-        cJSON* vocab_projection_save = cJSON_CreateObject();
-        cJSON* vocab_projection_save_weights = cJSON_CreateArray();
-        cJSON* vocab_projection_save_biases = cJSON_CreateArray();
+        //For the tables indexed by token (embeddings, vocab projection). A delta checkpoint writes only the rows that changed,
+        //gathered into one entry, with their ids in "<path>.rows".
+        bool queue_rows(char* path, float* tensor, size_t rows, size_t row_len){
+            if (!use_delta){
+                return queue_tensor(path, tensor, rows * row_len);
+            }
+            index_tensor(path, tensor, rows * row_len);
+            float* parts[3] = {tensor, adam_m(tensor), adam_v(tensor)};
+            int32_t* changed = malloc(rows * sizeof(int32_t));
+            if (!changed){
+                printf("Failed to allocate memory to save model.\n");
+                return false;
+            }
+            size_t changed_len = 0;
+            for (size_t row = 0; row < rows; row++){
+                for (int plane = 0; plane < 3; plane++){
+                    if (changed_since_reference(parts[plane] + row * row_len, row_len)){
+                        changed[changed_len++] = row;
+                        break;
+                    }
+                }
+            }
+            if (changed_len == 0){
+                free(changed);
+                return true;
+            }
+            float* gathered = malloc(changed_len * row_len * 3 * sizeof(float));
+            if (!gathered){
+                printf("Failed to allocate memory to save model.\n");
+                free(changed);
+                return false;
+            }
+            for (int plane = 0; plane < 3; plane++){
+                for (size_t index = 0; index < changed_len; index++){
+                    memcpy(gathered + (plane * changed_len + index) * row_len, parts[plane] + changed[index] * row_len, row_len * sizeof(float));
+                }
+            }
 
-        cJSON_AddItemToArray(vocab_projection_save_weights, cJSON_CreateString("vocab_projection.weights"));
-        cJSON_AddItemToArray(vocab_projection_save_biases, cJSON_CreateString("vocab_projection.biases"));
+            char rows_path[strlen(path) + strlen(".rows") + 1];
+            sprintf(rows_path, "%s.rows", path);
+            deflate_job* job = add_job(rows_path);
+            if (!job){
+                free(changed);
+                free(gathered);
+                return false;
+            }
+            job->planes = 1;
+            job->parts[0] = changed;
+            job->part_size = changed_len * sizeof(int32_t);
+            job->owned = changed;
 
-        cJSON_AddItemToObject(vocab_projection_save, "weights", vocab_projection_save_weights);
-        cJSON_AddItemToObject(vocab_projection_save, "biases", vocab_projection_save_biases);
+            job = add_job(path);
+            if (!job){
+                free(gathered);
+                return false;
+            }
+            job->planes = 3;
+            for (int plane = 0; plane < 3; plane++){
+                job->parts[plane] = gathered + plane * changed_len * row_len;
+            }
+            job->part_size = changed_len * row_len * sizeof(float);
+            job->shuffle = use_shuffle;
+            job->owned = gathered;
+            tensors_written++;
+            return true;
+        }
 
-        cJSON_AddItemToObject(transformer_structure_save, "vocab_projection", vocab_projection_save);
+        //Deflates the queued tensors on every core, each one goes into the zip as soon as it and the ones before it are done.
+        bool write_tensors(mz_zip_archive* zip, int level){
+            if (level == MZ_NO_COMPRESSION){
+                bool ok = true;
+                for (int index = 0; index < jobs_len; index++){
+                    if (ok){
+                        ok = mz_zip_writer_add_read_buf_callback(zip, jobs[index].path, read_planes, &jobs[index], jobs[index].part_size * jobs[index].planes, NULL, NULL, 0, MZ_NO_COMPRESSION, NULL, 0, NULL, 0);
+                    }
+                    free(jobs[index].path);
+                    free(jobs[index].owned);
+                }
+                free(jobs);
+                jobs = NULL;
+                jobs_len = 0;
+                jobs_cap = 0;
+                return ok;
+            }
+
+            deflate_queue queue;
+            queue.jobs = jobs;
+            queue.jobs_len = jobs_len;
+            queue.next = 0;
+            queue.written = 0;
+            queue.comp_flags = tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+            pthread_mutex_init(&queue.lock, NULL);
+            pthread_cond_init(&queue.changed, NULL);
+
+            int threads = cpu_count();
+            if (threads > jobs_len){
+                threads = jobs_len;
+            }
+            queue.window = threads * 4;
+            pthread_t* workers = malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+            int started = 0;
+            if (workers){
+                while ((started < threads) && (pthread_create(&workers[started], NULL, deflate_worker, &queue) == 0)){
+                    started++;
+                }
+            }
+            if (started == 0){
+                //No threads, deflate everything here first.
+                queue.window = jobs_len;
+                deflate_worker(&queue);
+            }
+
+            bool ok = true;
+            for (int index = 0; index < jobs_len; index++){
+                pthread_mutex_lock(&queue.lock);
+                while (!jobs[index].done){
+                    pthread_cond_wait(&queue.changed, &queue.lock);
+                }
+                pthread_mutex_unlock(&queue.lock);
+
+                //Keep draining after a failure so the workers can finish.
+                if (ok){
+                    ok = jobs[index].ok && mz_zip_writer_add_mem_ex_v2(zip, jobs[index].path, jobs[index].data, jobs[index].data_size, NULL, 0, level | MZ_ZIP_FLAG_COMPRESSED_DATA, jobs[index].part_size * jobs[index].planes, jobs[index].crc, NULL, NULL, 0, NULL, 0);
+                }
+                free(jobs[index].data);
+                free(jobs[index].path);
+                free(jobs[index].owned);
+
+                pthread_mutex_lock(&queue.lock);
+                queue.written = index + 1;
+                pthread_cond_broadcast(&queue.changed);
+                pthread_mutex_unlock(&queue.lock);
+            }
+
+            for (int index = 0; index < started; index++){
+                pthread_join(workers[index], NULL);
+            }
+            free(workers);
+            free(jobs);
+            jobs = NULL;
+            jobs_len = 0;
+            jobs_cap = 0;
+            pthread_mutex_destroy(&queue.lock);
+            pthread_cond_destroy(&queue.changed);
+            return ok;
+        }
+
+        //The metadata is written out as JSON text directly, its size only depends on layersAmount and heads.
+        out_buffer meta = {0};
+        buf_printf(&meta, "{\"layout\":\"planar\"");
+        if (use_shuffle){
+            buf_printf(&meta, ",\"filter\":\"shuffle\"");
+        }
+        if (values_only){
+            buf_printf(&meta, ",\"inference_only\":true");
+        }
+        if (use_xor || use_delta){
+            char* base_path = path_relative_to(xor_reference_path, filepath);
+            if (!base_path){
+                printf("Failed to allocate memory to save model.\n");
+                free(meta.data);
+                return false;
+            }
+            buf_printf(&meta, use_xor ? ",\"xor_base\":" : ",\"delta_base\":");
+            buf_json_string(&meta, base_path);
+            buf_printf(&meta, use_xor ? ",\"xor_depth\":%d" : ",\"delta_depth\":%d", xor_reference_depth + 1);
+            free(base_path);
+        }
+        buf_printf(&meta, ",\"contextSize\":%d,\"embeddingSize\":%d,\"learningRate\":%.17g,\"maxOutputSize\":%d,\"layersAmount\":%d,\"heads\":%d", contextSize, embeddingSize, learningRate, maxOutputSize, layersAmount, heads);
+        buf_printf(&meta, ",\"biasesinitrange\":[%.17g,%.17g],\"embeddinginitrange\":[%.17g,%.17g]", biasesinitrange[0], biasesinitrange[1], embeddinginitrange[0], embeddinginitrange[1]);
+        buf_printf(&meta, ",\"adam_params\":{\"beta1\":%.17g,\"beta2\":%.17g,\"epsilon\":%.17g,\"t\":%d},\"step_num\":%d", adam_params.beta1, adam_params.beta2, adam_params.epsilon, adam_params.t, step_num);
 
-        cJSON_AddItemToObject(model_meta_root, "transformer_structure", transformer_structure_save);
+        //One layer's weights or biases, kind is "weights" or "biases".
+        void write_layer_paths(int index, const char* kind){
+            buf_printf(&meta, "{\"normalize_1\":[\"layers[%d].%s.normalize_1\"],\"normalize_2\":[\"layers[%d].%s.normalize_2\"],\"attention\":{\"heads\":[", index, kind, index, kind);
+            for (int subindex = 0; subindex < heads; subindex++){
+                buf_printf(&meta, "%s{\"query\":[\"layers[%d].%s.attention.heads[%d].query\"]", subindex ? "," : "", index, kind, subindex);
+                buf_printf(&meta, ",\"key\":[\"layers[%d].%s.attention.heads[%d].key\"]", index, kind, subindex);
+                buf_printf(&meta, ",\"value\":[\"layers[%d].%s.attention.heads[%d].value\"]}", index, kind, subindex);
+            }
+            buf_printf(&meta, "],\"output\":[\"layers[%d].%s.attention.output\"]}", index, kind);
+            buf_printf(&meta, ",\"feed_forward\":{\"grow\":[\"layers[%d].%s.feed_forward.grow\"],\"shrink\":[\"layers[%d].%s.feed_forward.shrink\"]}}", index, kind, index, kind);
+        }
 
-        char* model_meta_save = cJSON_PrintUnformatted(model_meta_root);
-        size_t model_meta_save_len = strlen(model_meta_save);
-        cJSON_Delete(model_meta_root);
+        buf_printf(&meta, ",\"transformer_structure\":{\"layers\":[");
+        for (int index = 0; index < layersAmount; index++){
+            buf_printf(&meta, "%s{\"weights\":", index ? "," : "");
+            write_layer_paths(index, "weights");
+            buf_printf(&meta, ",\"biases\":");
+            write_layer_paths(index, "biases");
+            buf_printf(&meta, "}");
+        }
+        //The whole table is one tensor, rows at gap ids included. "ids" lists the ids that have a token so loaders can check the vocabulary.
+        buf_printf(&meta, "],\"embeddings\":{\"rows\":%d,\"table\":[\"embeddings\"],\"ids\":\"embeddings.ids\"}", vocab_len + gap_size);
+        buf_printf(&meta, ",\"vocab_projection\":{\"weights\":[\"vocab_projection.weights\"],\"biases\":[\"vocab_projection.biases\"]}}}");
+        if (meta.failed){
+            printf("Failed to allocate memory to save model.\n");
+            free(meta.data);
+            return false;
+        }
 
         //now zip it
         mz_zip_archive zipfile;
         memset(&zipfile, 0, sizeof(zipfile));
         
-        if (!mz_zip_writer_init_file(&zipfile, filepath, 0)){
+        //Written through one big stdio buffer, miniz itself only writes in small pieces.
+        size_t zip_buffer_size = 8 * 1024 * 1024;
+        char* zip_buffer = malloc(zip_buffer_size);
+        FILE* zip_out = fopen(filepath, "wb");
+        if ((!zip_out) || (!zip_buffer)){
             printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+            if (zip_out){
+                fclose(zip_out);
+            }
+            free(zip_buffer);
+            free(meta.data);
             return false;
         }
+        setvbuf(zip_out, zip_buffer, _IOFBF, zip_buffer_size);
+
+        //Ends the writer and closes the file, false if the last writes didn't make it to disk.
+        bool end_zip(mz_zip_archive* zip){
+            mz_zip_writer_end(zip);
+            bool closed = fclose(zip_out) == 0;
+            free(zip_buffer);
+            free(index_file.data);
+            index_file.data = NULL;
+            return closed;
+        }
 
-        if (!mz_zip_writer_add_mem(&zipfile, "model_meta.json", model_meta_save, model_meta_save_len, MZ_BEST_COMPRESSION)){
+        if (!mz_zip_writer_init_cfile(&zipfile, zip_out, 0)){
             printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-            mz_zip_writer_end(&zipfile);
+            fclose(zip_out);
+            free(zip_buffer);
+            free(meta.data);
             return false;
         }
 
-        free(model_meta_save);
+        bool meta_saved = mz_zip_writer_add_mem(&zipfile, "model_meta.json", meta.data, meta.len, checkpoint_level);
+        free(meta.data);
+        if (!meta_saved){
+            printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+            end_zip(&zipfile);
+            return false;
+        }
 
         for (int index = 0; index < layersAmount; index++){
             char _num[32];
@@ -3146,17 +6708,17 @@ int main(int argc, char** argv){
             char normalize_path[strlen(_num) + strlen("layers[].weights.normalize_1") + 1];
             sprintf(normalize_path, "layers[%s].weights.normalize_1", _num);
 
-            if (!mz_zip_writer_add_mem(&zipfile, normalize_path, layers[index].weights.normalize_1, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(normalize_path, layers[index].weights.normalize_1, embeddingSize)){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
             sprintf(normalize_path, "layers[%s].weights.normalize_2", _num);
 
-            if (!mz_zip_writer_add_mem(&zipfile, normalize_path, layers[index].weights.normalize_2, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(normalize_path, layers[index].weights.normalize_2, embeddingSize)){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
@@ -3166,47 +6728,47 @@ int main(int argc, char** argv){
                 char head_data_path[strlen(_num) + strlen(_num2) + strlen("layers[].weights.attention.heads[].query") + 1];
                 sprintf(head_data_path, "layers[%s].weights.attention.heads[%s].query", _num, _num2);
 
-                if (!mz_zip_writer_add_mem(&zipfile, head_data_path, layers[index].weights.attention.heads[subindex].query, embeddingSize * embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+                if (!queue_tensor(head_data_path, layers[index].weights.attention.heads[subindex].query, embeddingSize * embeddingSize)){
                     printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                    mz_zip_writer_end(&zipfile);
+                    end_zip(&zipfile);
                     return false;
                 }
 
                 sprintf(head_data_path, "layers[%s].weights.attention.heads[%s].key", _num, _num2);
-                if (!mz_zip_writer_add_mem(&zipfile, head_data_path, layers[index].weights.attention.heads[subindex].key, embeddingSize * embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+                if (!queue_tensor(head_data_path, layers[index].weights.attention.heads[subindex].key, embeddingSize * embeddingSize)){
                     printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                    mz_zip_writer_end(&zipfile);
+                    end_zip(&zipfile);
                     return false;
                 }
 
                 sprintf(head_data_path, "layers[%s].weights.attention.heads[%s].value", _num, _num2);
-                if (!mz_zip_writer_add_mem(&zipfile, head_data_path, layers[index].weights.attention.heads[subindex].value, embeddingSize * embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+                if (!queue_tensor(head_data_path, layers[index].weights.attention.heads[subindex].value, embeddingSize * embeddingSize)){
                     printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                    mz_zip_writer_end(&zipfile);
+                    end_zip(&zipfile);
                     return false;
                 }
             }
 
             char attn_o_path[strlen(_num) + strlen("layers[].weights.attention.output") + 1];
             sprintf(attn_o_path, "layers[%s].weights.attention.output", _num);
-            if (!mz_zip_writer_add_mem(&zipfile, attn_o_path, layers[index].weights.attention.output, embeddingSize * (embeddingSize * heads) * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(attn_o_path, layers[index].weights.attention.output, embeddingSize * (embeddingSize * heads))){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
             char ffw_paths[strlen(_num) + strlen("layers[].weights.feed_forward.shrink") + 1];
             sprintf(ffw_paths, "layers[%s].weights.feed_forward.grow", _num);
-            if (!mz_zip_writer_add_mem(&zipfile, ffw_paths, layers[index].weights.feed_forward.grow, embeddingSize * (embeddingSize * 4) * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(ffw_paths, layers[index].weights.feed_forward.grow, embeddingSize * (embeddingSize * 4))){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
             sprintf(ffw_paths, "layers[%s].weights.feed_forward.shrink", _num);
-            if (!mz_zip_writer_add_mem(&zipfile, ffw_paths, layers[index].weights.feed_forward.shrink, embeddingSize * (embeddingSize * 4) * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(ffw_paths, layers[index].weights.feed_forward.shrink, embeddingSize * (embeddingSize * 4))){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
@@ -3216,17 +6778,17 @@ int main(int argc, char** argv){
             char normalize_path_[strlen(_num) + strlen("layers[].biases.normalize_1") + 1];
             sprintf(normalize_path_, "layers[%s].biases.normalize_1", _num);
 
-            if (!mz_zip_writer_add_mem(&zipfile, normalize_path_, layers[index].biases.normalize_1, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(normalize_path_, layers[index].biases.normalize_1, embeddingSize)){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
             sprintf(normalize_path_, "layers[%s].biases.normalize_2", _num);
 
-            if (!mz_zip_writer_add_mem(&zipfile, normalize_path_, layers[index].biases.normalize_2, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(normalize_path_, layers[index].biases.normalize_2, embeddingSize)){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
@@ -3236,92 +6798,452 @@ int main(int argc, char** argv){
                 char head_data_path[strlen(_num) + strlen(_num2) + strlen("layers[].biases.attention.heads[].query") + 1];
                 sprintf(head_data_path, "layers[%s].biases.attention.heads[%s].query", _num, _num2);
 
-                if (!mz_zip_writer_add_mem(&zipfile, head_data_path, layers[index].biases.attention.heads[subindex].query, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+                if (!queue_tensor(head_data_path, layers[index].biases.attention.heads[subindex].query, embeddingSize)){
                     printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                    mz_zip_writer_end(&zipfile);
+                    end_zip(&zipfile);
                     return false;
                 }
 
                 sprintf(head_data_path, "layers[%s].biases.attention.heads[%s].key", _num, _num2);
-                if (!mz_zip_writer_add_mem(&zipfile, head_data_path, layers[index].biases.attention.heads[subindex].key, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+                if (!queue_tensor(head_data_path, layers[index].biases.attention.heads[subindex].key, embeddingSize)){
                     printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                    mz_zip_writer_end(&zipfile);
+                    end_zip(&zipfile);
                     return false;
                 }
 
                 sprintf(head_data_path, "layers[%s].biases.attention.heads[%s].value", _num, _num2);
-                if (!mz_zip_writer_add_mem(&zipfile, head_data_path, layers[index].biases.attention.heads[subindex].value, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+                if (!queue_tensor(head_data_path, layers[index].biases.attention.heads[subindex].value, embeddingSize)){
                     printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                    mz_zip_writer_end(&zipfile);
+                    end_zip(&zipfile);
                     return false;
                 }
             }
 
             char attn_o_path_[strlen(_num) + strlen("layers[].biases.attention.output") + 1];
             sprintf(attn_o_path_, "layers[%s].biases.attention.output", _num);
-            if (!mz_zip_writer_add_mem(&zipfile, attn_o_path_, layers[index].biases.attention.output, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(attn_o_path_, layers[index].biases.attention.output, embeddingSize)){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
             char ffw_paths_[strlen(_num) + strlen("layers[].biases.feed_forward.shrink") + 1];
             sprintf(ffw_paths_, "layers[%s].biases.feed_forward.grow", _num);
-            if (!mz_zip_writer_add_mem(&zipfile, ffw_paths_, layers[index].biases.feed_forward.grow, (embeddingSize * 4) * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(ffw_paths_, layers[index].biases.feed_forward.grow, (embeddingSize * 4))){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
 
             sprintf(ffw_paths_, "layers[%s].biases.feed_forward.shrink", _num);
-            if (!mz_zip_writer_add_mem(&zipfile, ffw_paths_, layers[index].biases.feed_forward.shrink, embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+            if (!queue_tensor(ffw_paths_, layers[index].biases.feed_forward.shrink, embeddingSize)){
                 printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
+                end_zip(&zipfile);
                 return false;
             }
         }
 
-        for (int index = 0; index < vocab_len + gap_size; index++){
-            if (!id_to_token(index)){
-                continue; //skip gaps
+        int32_t* embedding_ids = malloc(vocab_len * sizeof(int32_t));
+        if (!embedding_ids){
+            printf("Failed to allocate memory to save model.\n");
+            end_zip(&zipfile);
+            return false;
+        }
+        int embedding_ids_len = 0;
+        for (int index = 0; (index < vocab_len + gap_size) && (embedding_ids_len < vocab_len); index++){
+            if (id_to_token(index)){
+                embedding_ids[embedding_ids_len++] = index;
             }
-            char _num[32];
-            itoa(index, _num, 10);
-            char embeddingPath[strlen(_num) + strlen("embeddings[]") + 1];
-            sprintf(embeddingPath, "embeddings[%s]", _num);
+        }
+        bool ids_saved = mz_zip_writer_add_mem(&zipfile, "embeddings.ids", embedding_ids, embedding_ids_len * sizeof(int32_t), checkpoint_level);
+        free(embedding_ids);
+        if (!ids_saved){
+            printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+            end_zip(&zipfile);
+            return false;
+        }
 
-            if (!mz_zip_writer_add_mem(&zipfile, embeddingPath, embeddings[index], embeddingSize * sizeof(float), MZ_BEST_COMPRESSION)){
-                printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-                mz_zip_writer_end(&zipfile);
-                return false;
-            }
+        if (!queue_rows("embeddings", embeddings, vocab_len + gap_size, embeddingSize)){
+            printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+            end_zip(&zipfile);
+            return false;
+        }
+
+        if (!queue_rows("vocab_projection.weights", vocab_projection.weights, vocab_len, embeddingSize)){
+            printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+            end_zip(&zipfile);
+            return false;
+        }
+
+        if (!queue_tensor("vocab_projection.biases", vocab_projection.biases, vocab_len)){
+            printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
+            end_zip(&zipfile);
+            return false;
+        }
+
+        if (use_delta){
+            printf("Only %d of %d tensors changed since \"%s\".\n", tensors_written, index_header.count, xor_reference_path);
         }
 
-        if (!mz_zip_writer_add_mem(&zipfile, "vocab_projection.weights", vocab_projection.weights, vocab_len * embeddingSize * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+        if (!index_file.failed){
+            memcpy(index_file.data, &index_header, sizeof index_header);
+        }
+        bool index_saved = (!index_file.failed) && mz_zip_writer_add_mem(&zipfile, "tensors.idx", index_file.data, index_file.len, checkpoint_level);
+        free(index_file.data);
+        index_file.data = NULL;
+        if (!index_saved){
             printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-            mz_zip_writer_end(&zipfile);
+            end_zip(&zipfile);
             return false;
         }
 
-        if (!mz_zip_writer_add_mem(&zipfile, "vocab_projection.biases", vocab_projection.biases, vocab_len * 3 * sizeof(float), MZ_BEST_COMPRESSION)){
+        if (!write_tensors(&zipfile, checkpoint_level)){
             printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-            mz_zip_writer_end(&zipfile);
+            end_zip(&zipfile);
             return false;
         }
 
         if (!mz_zip_writer_finalize_archive(&zipfile)) {
             printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
-            mz_zip_writer_end(&zipfile);
+            end_zip(&zipfile);
+            return false;
+        }
+
+        if (!end_zip(&zipfile)){
+            printf("Failed to save model at path \"%s\". Common causes are: Not enough storage space or no permissions.\n", filepath);
             return false;
         }
 
-        mz_zip_writer_end(&zipfile);
+        //A snapshot child would only copy the whole arena to throw it away on exit, reap_snapshot() updates the parent's.
+        if (keep_checkpoint_reference && (!values_only) && (!in_snapshot_child)){
+            set_xor_reference(filepath, (use_xor || use_delta) ? xor_reference_depth + 1 : 0, arena, use_xor || use_delta);
+        }
 
         printf("Saved model at path \"%s\" in %lldms.\n", filepath, timer_end(save_timer));
 
         return true;
     }
-    save("bruh.zip");
+
+    //Background checkpoints (async-checkpoints). The arena is shared memory, which fork() doesn't copy on write,
+    //so the child copies it into its own memory while this process waits, then saves that copy while this process keeps training.
+    char* snapshot = NULL; //what the arena was when the running snapshot started, only kept when it becomes the next checkpoint reference
+    char* snapshot_path = NULL;
+    int snapshot_xor_depth = 0;
+    long long snapshot_timer = 0;
+#ifndef _WIN32
+    pid_t snapshot_pid = -1;
+#endif
+
+    //Collects the snapshot being written, if any. Only waits for it if block is set, false if it failed.
+    bool reap_snapshot(bool block){
+#ifdef _WIN32
+        return true;
+#else
+        if (snapshot_pid == -1){
+            return true;
+        }
+        int status;
+        pid_t done = waitpid(snapshot_pid, &status, block ? 0 : WNOHANG);
+        if (done == 0){
+            return true;
+        }
+        snapshot_pid = -1;
+        if ((done == -1) || (!WIFEXITED(status)) || (WEXITSTATUS(status) != 0)){
+            printf("Background save of model at path \"%s\" failed.\n", snapshot_path);
+            free(snapshot);
+            snapshot = NULL;
+            return false;
+        }
+        printf("Background save of model at path \"%s\" finished in %lldms.\n", snapshot_path, timer_end(snapshot_timer));
+        if (snapshot){
+            //Hand the buffer over instead of copying it again.
+            free(xor_reference);
+            xor_reference = snapshot;
+            snapshot = NULL;
+            set_xor_reference(snapshot_path, snapshot_xor_depth, xor_reference, snapshot_xor_depth > 0);
+        }
+        return true;
+#endif
+    }
+
+    //Like save(filepath, false) but returns as soon as the arena is copied. Only one snapshot is written at a time,
+    //if the previous one is still going this waits for it first.
+    bool save_snapshot(char* filepath){
+#ifdef _WIN32
+        return save(filepath, false);
+#else
+        if (snapshot_pid != -1){
+            printf("Waiting for the previous background save to finish...\n");
+            reap_snapshot(true);
+        }
+        if (keep_checkpoint_reference && (!native_checkpoints)){
+            snapshot = malloc(arena_size);
+            if (!snapshot){
+                printf("Failed to allocate memory for a snapshot, saving in the foreground instead.\n");
+                return save(filepath, false);
+            }
+        }
+        char* path_copy = malloc(strlen(filepath) + 1);
+        if (!path_copy){
+            printf("Failed to allocate memory for a snapshot, saving in the foreground instead.\n");
+            free(snapshot);
+            snapshot = NULL;
+            return save(filepath, false);
+        }
+        strcpy(path_copy, filepath);
+        free(snapshot_path);
+        snapshot_path = path_copy;
+
+        snapshot_xor_depth = (xor_against_reference(filepath, false) || delta_against_reference(filepath, false)) ? xor_reference_depth + 1 : 0; //what the child will decide too
+        snapshot_timer = timer();
+        int copied[2]; //the child writes a byte once it has its copy, this process doesn't touch the arena until then
+        if (pipe(copied) == -1){
+            printf("Failed to start a background save, saving in the foreground instead.\n");
+            free(snapshot);
+            snapshot = NULL;
+            return save(filepath, false);
+        }
+        fflush(stdout); //or the child flushes its own copy of whatever is buffered
+        pid_t pid = fork();
+        if (pid == -1){
+            printf("Failed to start a background save, saving in the foreground instead.\n");
+            close(copied[0]);
+            close(copied[1]);
+            free(snapshot);
+            snapshot = NULL;
+            return save(filepath, false);
+        }
+        if (pid == 0){
+            shm_forget();
+            close(copied[0]);
+            in_snapshot_child = true;
+            char* copy = malloc(arena_size);
+            if (!copy){
+                _exit(1); //closing the pipe without a byte sends the parent to a foreground save
+            }
+            memcpy(copy, arena, arena_size);
+            char ready = 1;
+            if (write(copied[1], &ready, 1) != 1){
+                _exit(1);
+            }
+            close(copied[1]);
+            free(snapshot); //the parent's, not ours to keep
+            arena = copy;
+            layout_model(arena);
+            bool ok = save(filepath, false);
+            fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+        close(copied[1]);
+        if (snapshot){
+            memcpy(snapshot, arena, arena_size); //alongside the child's copy
+        }
+        char ready = 0;
+        ssize_t got;
+        do {
+            got = read(copied[0], &ready, 1);
+        } while ((got == -1) && (errno == EINTR));
+        close(copied[0]);
+        if (got != 1){
+            waitpid(pid, NULL, 0);
+            printf("Failed to start a background save, saving in the foreground instead.\n");
+            free(snapshot);
+            snapshot = NULL;
+            return save(filepath, false);
+        }
+        snapshot_pid = pid;
+        printf("Saving model at path \"%s\" in the background.\n", filepath);
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    //Worker pool (--workers): this process owns the model and every worker maps it read only, so the weights are resident once however many workers run.
+    //Requests are lines on stdin handed out round robin. There's no forward pass yet so a worker answers with the request's tokens.
+    void serve_requests(int worker, int fd){
+        FILE* requests = fdopen(fd, "r");
+        if (!requests){
+            write_line(STDOUT_FILENO, "[Worker %d] Failed to open its request pipe.\n", worker);
+            return;
+        }
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len;
+        while ((line_len = getline(&line, &line_cap, requests)) != -1){
+            ws_reset(); //Each request is a step, nothing in the workspace outlives it.
+            if ((line_len > 0) && (line[line_len - 1] == '\n')){
+                line[line_len - 1] = '\0';
+            }
+            int* tokens = tokenize(line);
+            if (!tokens){
+                write_line(STDOUT_FILENO, "[Worker %d] Failed to tokenize \"%s\".\n", worker, line);
+                continue;
+            }
+            //One write per answer so answers from different workers don't interleave.
+            size_t reply_cap = 64 + (size_t)tokens[0] * 12;
+            char* reply = malloc(reply_cap);
+            if (!reply){
+                write_line(STDOUT_FILENO, "[Worker %d] Failed to allocate memory to answer a request.\n", worker);
+                free(tokens);
+                continue;
+            }
+            size_t reply_len = snprintf(reply, reply_cap, "[Worker %d] Token ids:", worker);
+            for (int index = 1; index < tokens[0] + 1; index++){
+                reply_len += snprintf(reply + reply_len, reply_cap - reply_len, " %d", tokens[index]);
+            }
+            reply_len += snprintf(reply + reply_len, reply_cap - reply_len, "\n");
+            if (write(STDOUT_FILENO, reply, reply_len) == -1){
+                free(reply);
+                free(tokens);
+                break;
+            }
+            free(reply);
+            free(tokens);
+        }
+        free(line);
+        fclose(requests);
+    }
+
+    //Closing a worker's request pipe is its signal to finish, then it's reaped.
+    void stop_workers(int* request_fds, pid_t* pids, int started){
+        for (int index = 0; index < started; index++){
+            if (request_fds[index] != -1){
+                close(request_fds[index]);
+            }
+        }
+        for (int index = 0; index < started; index++){
+            waitpid(pids[index], NULL, 0);
+        }
+        free(request_fds);
+        free(pids);
+    }
+
+    bool run_workers(){
+        int* request_fds = malloc(workers * sizeof(int));
+        pid_t* pids = malloc(workers * sizeof(pid_t));
+        if ((!request_fds) || (!pids)){
+            printf("Failed to allocate memory to start workers.\n");
+            free(request_fds);
+            free(pids);
+            return false;
+        }
+        fflush(stdout); //or every child flushes its own copy of whatever is buffered
+        for (int index = 0; index < workers; index++){
+            int fds[2];
+            if (pipe(fds) == -1){
+                printf("Failed to create a request pipe for worker %d.\n", index);
+                stop_workers(request_fds, pids, index);
+                return false;
+            }
+            pid_t pid = fork();
+            if (pid == -1){
+                printf("Failed to start worker %d.\n", index);
+                close(fds[0]);
+                close(fds[1]);
+                stop_workers(request_fds, pids, index);
+                return false;
+            }
+            if (pid == 0){
+                shm_forget();
+                setvbuf(stdout, NULL, _IONBF, 0); //anything printed from shared code goes out right away too, not at some later flush
+                for (int subindex = 0; subindex < index; subindex++){
+                    close(request_fds[subindex]);
+                }
+                close(fds[1]);
+                //Swap the inherited writable mapping for a read only one, a stray write in a worker now faults instead of corrupting everyone's model.
+                if (file_map){
+                    if (mprotect(file_map, file_map_size, PROT_READ) == -1){
+                        _exit(1);
+                    }
+                }
+                else{
+                    munmap(arena, shm_mapped_size(arena_size));
+                    if (!map_model_readonly()){
+                        _exit(1);
+                    }
+                }
+                serve_requests(index, fds[0]);
+                _exit(0);
+            }
+            close(fds[0]);
+            request_fds[index] = fds[1];
+            pids[index] = pid;
+        }
+        printf("Started %d workers sharing model \"%s\", enter strings to tokenize:\n", workers, model_id);
+        fflush(stdout);
+
+        signal(SIGPIPE, SIG_IGN); //a dead worker shows up as a failed write instead of killing us
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len;
+        int next = 0;
+        int alive = workers;
+        while ((alive > 0) && ((line_len = getline(&line, &line_cap, stdin)) != -1)){
+            //Dead workers are taken out of the rotation (their fd set to -1) and the line goes to the next live one.
+            bool sent = false;
+            while ((!sent) && (alive > 0)){
+                if (request_fds[next] != -1){
+                    if (write(request_fds[next], line, line_len) == -1){
+                        printf("Worker %d stopped answering, its requests will go to the others.\n", next);
+                        close(request_fds[next]);
+                        request_fds[next] = -1;
+                        alive--;
+                    }
+                    else{
+                        sent = true;
+                    }
+                }
+                next = (next + 1) % workers;
+            }
+            if (!sent){
+                printf("Every worker stopped answering, dropped a request.\n");
+            }
+        }
+        free(line);
+
+        for (int index = 0; index < workers; index++){
+            if (request_fds[index] != -1){
+                close(request_fds[index]);
+            }
+        }
+        bool ok = true;
+        for (int index = 0; index < workers; index++){
+            int status;
+            if ((waitpid(pids[index], &status, 0) == -1) || (!WIFEXITED(status)) || (WEXITSTATUS(status) != 0)){
+                printf("Worker %d exited abnormally.\n", index);
+                ok = false;
+            }
+        }
+        free(request_fds);
+        free(pids);
+        return ok;
+    }
+#endif
+
+    if (export_location){
+        if (!save(export_location, true)){
+            return 1;
+        }
+    }
+
+    if (workers){
+#ifdef _WIN32
+        printf("--workers needs fork, it isn't available on windows.\n");
+        return 1;
+#else
+        return run_workers() ? 0 : 1;
+#endif
+    }
+
+    if (async_checkpoints){
+        save_snapshot("bruh.zip");
+        if (!reap_snapshot(true)){
+            return 1;
+        }
+    }
+    else{
+        save("bruh.zip", false);
+    }
     return 0;
 
     printf("Enter strings to tokenize:\n");